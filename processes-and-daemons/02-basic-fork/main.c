@@ -1,12 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <syslog.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "logring.h"
 #include "util.h"
 
 int main (int argc, char **argv)
 {
+	/*
+	 * create a log ring shared by this process and its children.  A
+	 * collector process writes their lines to stdout in order.
+	 */
+	logring_create(LOGRING_STDOUT);
+
 	/* who am i */
 	report_pgs("My");
 
@@ -18,7 +26,7 @@ int main (int argc, char **argv)
 		report_pgs("Parent");
 
 		/* make the child an orphan */
-		printf("Parent exiting ...\n");
+		log_line(LOG_INFO, "Parent exiting ...");
 		exit(EXIT_SUCCESS);
 	}
 
@@ -32,7 +40,7 @@ int main (int argc, char **argv)
 	/* wait briefly before exiting */
 	sleep(5);
 
-	printf("Child exiting\n");
+	log_line(LOG_INFO, "Child exiting");
 	return EXIT_SUCCESS;
 }
 
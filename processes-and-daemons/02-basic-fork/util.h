@@ -2,6 +2,7 @@
 #define __UTIL_H__
 
 void die(int line_number, const char *message);
+void log_line(int priority, const char *format, ...);
 void report_pgs(char *name);
 
 #endif
@@ -0,0 +1,27 @@
+#ifndef __LOGRING_H__
+#define __LOGRING_H__
+
+#include <stdarg.h>
+
+/*
+ * Number of records in the ring.  Must be a power of two.
+ */
+#define LOGRING_SLOTS 1024
+
+/*
+ * Longest message kept in a record.  Longer messages are truncated.
+ */
+#define LOGRING_TEXT_MAX 240
+
+/*
+ * Where the collector writes records
+ */
+#define LOGRING_STDOUT 1
+#define LOGRING_SYSLOG 2
+
+int  logring_create(int sinks);
+int  logring_active();
+void logring_refresh();
+int  logring_vwrite(int priority, const char *format, va_list vargs);
+
+#endif
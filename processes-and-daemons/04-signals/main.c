@@ -5,18 +5,25 @@
 #include <unistd.h>
 //#include <wait.h>
 
+#include "logring.h"
 #include "util.h"
 
 void child_trap(int signum) {
-	syslog(LOG_INFO, "Child caught signal %d", signum);
+	log_line(LOG_INFO, "Child caught signal %d", signum);
 }
 
 void parent_trap(int signum) {
-	syslog(LOG_INFO, "Parent caught signal %d", signum);
+	log_line(LOG_INFO, "Parent caught signal %d", signum);
 }
 
 int main (int argc, char **argv)
 {
+	/*
+	 * create a log ring shared by this process and its children.  A
+	 * collector process writes their lines to syslog in order.
+	 */
+	logring_create(LOGRING_SYSLOG);
+
 	/* who am i */
 	report_pgs("My");
 
@@ -35,7 +42,7 @@ int main (int argc, char **argv)
 //		wait(&wstatus);
 
 		/* make the child an orphan */
-		syslog(LOG_INFO, "Parent exiting ...");
+		log_line(LOG_INFO, "Parent exiting ...");
 		exit(EXIT_SUCCESS);
 	}
 
@@ -46,7 +53,7 @@ int main (int argc, char **argv)
 	signal(SIGINT, &child_trap);
 	sleep(1000);
 
-	syslog(LOG_INFO, "Child exiting ...");
+	log_line(LOG_INFO, "Child exiting ...");
 	return EXIT_SUCCESS;
 }
 
@@ -1,10 +1,12 @@
 #include <errno.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "logring.h"
 #include "util.h"
 
 void die (int linenum, const char *message)
@@ -13,17 +15,37 @@ void die (int linenum, const char *message)
 	exit (EXIT_FAILURE);
 }
 
+/*
+ * Log through the shared log ring if there is one, so that lines from
+ * different processes are not interleaved.  Otherwise, or if the ring is
+ * full, log directly.
+ */
+void log_line(int priority, const char *format, ...)
+{
+	va_list vargs;
+
+	va_start(vargs, format);
+	int rc = logring_vwrite(priority, format, vargs);
+	va_end(vargs);
+
+	if (rc == -1) {
+		va_start(vargs, format);
+		vsyslog(priority, format, vargs);
+		va_end(vargs);
+	}
+}
+
 void report_pgs(char *name) {
 	pid_t my_pid = getpid();
 	pid_t my_ppid = getppid();
 	pid_t my_pgid = getpgrp();
 	pid_t my_psid = getsid(my_pid); // or use getsid(0) for current process
 
-	syslog(LOG_INFO, "****************************************");
-	syslog(LOG_INFO, "%s Process Information", name);
-	syslog(LOG_INFO, "         Process ID: %05d", my_pid);
-	syslog(LOG_INFO, "  Parent Process ID: %05d", my_ppid);
-	syslog(LOG_INFO, "   Process Group ID: %05d", my_ppid);
-	syslog(LOG_INFO, "         Session ID: %05d", my_psid);
+	log_line(LOG_INFO, "****************************************");
+	log_line(LOG_INFO, "%s Process Information", name);
+	log_line(LOG_INFO, "         Process ID: %05d", my_pid);
+	log_line(LOG_INFO, "  Parent Process ID: %05d", my_ppid);
+	log_line(LOG_INFO, "   Process Group ID: %05d", my_ppid);
+	log_line(LOG_INFO, "         Session ID: %05d", my_psid);
 }
 
@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "event.h"
+#include "util.h"
+
+/*
+ * The control socket is a UNIX domain stream socket served from the main
+ * event loop.  Each request is one line of text, a command name followed by
+ * arguments separated by spaces.  The reply is zero or more lines of output
+ * followed by a line containing either "ok" or "error".  For example,
+ *
+ *     echo stats | socat - UNIX-CONNECT:/run/simple-daemon.sock
+ *
+ * Every socket is non-blocking so a slow or misbehaving client can never
+ * stall the daemon.
+ */
+
+struct command {
+    const char      *name;
+    const char      *help;
+    control_handler handler;
+};
+
+struct client {
+    int    fd;
+    size_t len;
+    char   line[CONTROL_LINE_MAX];
+};
+
+static struct command commands[CONTROL_MAX_COMMANDS];
+static int command_count = 0;
+
+static struct client clients[CONTROL_MAX_CLIENTS];
+static int listen_fd = -1;
+static char socket_path[PATH_MAX];
+
+int control_register(const char *name, const char *help,
+    control_handler handler) {
+    if (command_count == CONTROL_MAX_COMMANDS)
+        return -1;
+
+    commands[command_count].name = name;
+    commands[command_count].help = help;
+    commands[command_count].handler = handler;
+    command_count++;
+    return 0;
+}
+
+static int help_command(int argc, char **argv, char *reply,
+    size_t reply_size) {
+    size_t len = 0;
+
+    for (int i = 0; i < command_count && len < reply_size; i++)
+        len += snprintf(reply + len, reply_size - len, "%-10s %s\n",
+            commands[i].name, commands[i].help);
+    return 0;
+}
+
+static void drop_client(struct client *client) {
+    event_del(client->fd);
+    close(client->fd);
+    client->fd = -1;
+    client->len = 0;
+}
+
+/*
+ * Send a whole reply or give up on the client.  Replies are small, so a
+ * client that lets its receive buffer fill up is not worth waiting for.
+ */
+static void send_reply(struct client *client, const char *reply, size_t len) {
+    if (send(client->fd, reply, len, MSG_DONTWAIT | MSG_NOSIGNAL)
+        != (ssize_t)len)
+        drop_client(client);
+}
+
+static void run_command(struct client *client, char *line) {
+    char reply[CONTROL_REPLY_MAX];
+    char *argv[CONTROL_MAX_ARGS + 1];
+    char *saveptr;
+    int argc = 0;
+
+    for (char *arg = strtok_r(line, " \t\r", &saveptr);
+         arg && argc < CONTROL_MAX_ARGS;
+         arg = strtok_r(NULL, " \t\r", &saveptr))
+        argv[argc++] = arg;
+    argv[argc] = 0;
+
+    if (argc == 0)
+        return;
+
+    struct command *command = NULL;
+    for (int i = 0; i < command_count; i++)
+        if (strcmp(argv[0], commands[i].name) == 0) {
+            command = &commands[i];
+            break;
+        }
+
+    int rc = -1;
+    reply[0] = '\0';
+    if (command)
+        rc = command->handler(argc, argv, reply,
+            sizeof(reply) - sizeof("error\n"));
+    else
+        snprintf(reply, sizeof(reply), "unknown command %s\n", argv[0]);
+
+    /* the handlers leave room for the status line */
+    size_t len = strlen(reply);
+    len += sprintf(reply + len, rc == 0 ? "ok\n" : "error\n");
+    send_reply(client, reply, len);
+}
+
+/*
+ * Read whatever is available and run each complete line
+ */
+static void handle_client(int fd, unsigned int events, void *arg) {
+    struct client *client = arg;
+
+    ssize_t count = recv(fd, client->line + client->len,
+        sizeof(client->line) - client->len, MSG_DONTWAIT);
+    if (count == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (count <= 0) {
+        drop_client(client);
+        return;
+    }
+    client->len += count;
+
+    char *newline;
+    while (client->fd != -1
+           && (newline = memchr(client->line, '\n', client->len)) != NULL) {
+        *newline = '\0';
+        run_command(client, client->line);
+        if (client->fd == -1)
+            break;
+
+        size_t used = newline + 1 - client->line;
+        memmove(client->line, newline + 1, client->len - used);
+        client->len -= used;
+    }
+
+    if (client->fd != -1 && client->len == sizeof(client->line)) {
+        const char *too_long = "line too long\nerror\n";
+        send_reply(client, too_long, strlen(too_long));
+        if (client->fd != -1)
+            drop_client(client);
+    }
+}
+
+/*
+ * Only root and the user the daemon runs as may issue commands.  The kernel
+ * supplies the credentials of the connecting process, so they cannot be
+ * forged by the client.
+ */
+static int is_authorized(int fd) {
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1)
+        return 0;
+    return cred.uid == 0 || cred.uid == geteuid();
+}
+
+static void handle_accept(int fd, unsigned int events, void *arg) {
+    int client_fd;
+
+    while ((client_fd = accept4(fd, NULL, NULL,
+            SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        struct client *client = NULL;
+
+        for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+            if (clients[i].fd == -1) {
+                client = &clients[i];
+                break;
+            }
+
+        int authorized = is_authorized(client_fd);
+        if (!authorized || client == NULL
+            || event_add(client_fd, EPOLLIN, handle_client, client) == -1) {
+            const char *refused = "refused\nerror\n";
+
+            log_info("Refused control connection%s",
+                authorized ? ", too many clients" : " from unauthorized user");
+            send(client_fd, refused, strlen(refused),
+                MSG_DONTWAIT | MSG_NOSIGNAL);
+            close(client_fd);
+            continue;
+        }
+
+        client->fd = client_fd;
+        client->len = 0;
+        log_debug("Accepted control connection");
+    }
+}
+
+/*
+ * Create the control socket.  Only one daemon at a time holds the lock file,
+ * so any socket left at this path belongs to a predecessor that did not shut
+ * down cleanly and is safe to remove.
+ */
+int control_open(const char *path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    strcpy(socket_path, path);
+    unlink(path);
+
+    /*
+     * the daemon runs with a umask of 0, so restrict the socket to its owner
+     * while it is created
+     */
+    mode_t old_mask = umask(S_IRWXG | S_IRWXO);
+    int rc = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+
+    if (rc == -1
+        || listen(listen_fd, CONTROL_MAX_CLIENTS) == -1
+        || event_add(listen_fd, EPOLLIN, handle_accept, NULL) == -1) {
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    control_register("help", "List the available commands", help_command);
+    return 0;
+}
+
+void control_close() {
+    if (listen_fd == -1)
+        return;
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+        if (clients[i].fd != -1)
+            drop_client(&clients[i]);
+
+    event_del(listen_fd);
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(socket_path);
+}
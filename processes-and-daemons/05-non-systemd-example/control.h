@@ -0,0 +1,25 @@
+#ifndef __CONTROL_H__
+#define __CONTROL_H__
+
+#include <stddef.h>
+
+#define CONTROL_MAX_CLIENTS  8
+#define CONTROL_MAX_COMMANDS 16
+#define CONTROL_MAX_ARGS     8
+#define CONTROL_LINE_MAX     256
+#define CONTROL_REPLY_MAX    4096
+
+/*
+ * A command handler writes any reply lines into reply, which holds at most
+ * reply_size bytes, and returns 0 on success or -1 on failure.  argv[0] is
+ * the command name.
+ */
+typedef int (*control_handler)(int argc, char **argv, char *reply,
+    size_t reply_size);
+
+int  control_register(const char *name, const char *help,
+         control_handler handler);
+int  control_open(const char *path);
+void control_close();
+
+#endif
@@ -0,0 +1,83 @@
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "event.h"
+
+/*
+ * Most ready events handled per call to event_wait()
+ */
+#define EVENT_BATCH 32
+
+struct source {
+    event_handler handler;
+    void          *arg;
+};
+
+static int epoll_fd = -1;
+
+/*
+ * Handlers are looked up by file descriptor rather than stored in the epoll
+ * data.  A handler that removes another source while a batch is dispatched
+ * then simply causes that source's pending event to be skipped.
+ */
+static struct source sources[EVENT_MAX_FDS];
+
+int event_init() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return epoll_fd == -1 ? -1 : 0;
+}
+
+int event_add(int fd, unsigned int events, event_handler handler, void *arg) {
+    struct epoll_event ev;
+
+    if (fd < 0 || fd >= EVENT_MAX_FDS) {
+        errno = EMFILE;
+        return -1;
+    }
+
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        return -1;
+
+    sources[fd].handler = handler;
+    sources[fd].arg = arg;
+    return 0;
+}
+
+/*
+ * Stop watching a file descriptor.  This must be called before the descriptor
+ * is closed.
+ */
+void event_del(int fd) {
+    if (fd < 0 || fd >= EVENT_MAX_FDS)
+        return;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    sources[fd].handler = 0;
+    sources[fd].arg = 0;
+}
+
+/*
+ * Wait up to timeout_ms for events and dispatch them.  Like ppoll(),
+ * epoll_pwait() installs wait_mask only while waiting, so signals blocked
+ * elsewhere can still interrupt the wait without racing the caller's checks.
+ * Returns the number of events handled, or -1 if interrupted by a signal.
+ */
+int event_wait(int timeout_ms, const sigset_t *wait_mask) {
+    struct epoll_event ready[EVENT_BATCH];
+
+    int count = epoll_pwait(epoll_fd, ready, EVENT_BATCH, timeout_ms,
+        wait_mask);
+    if (count == -1)
+        return -1;
+
+    for (int i = 0; i < count; i++) {
+        struct source *src = &sources[ready[i].data.fd];
+        if (src->handler)
+            src->handler(ready[i].data.fd, ready[i].events, src->arg);
+    }
+
+    return count;
+}
@@ -0,0 +1,21 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include <signal.h>
+
+/*
+ * Highest file descriptor number that can be watched, plus one
+ */
+#define EVENT_MAX_FDS 1024
+
+/*
+ * Called with the file descriptor and the epoll events that are ready
+ */
+typedef void (*event_handler)(int fd, unsigned int events, void *arg);
+
+int  event_init();
+int  event_add(int fd, unsigned int events, event_handler handler, void *arg);
+void event_del(int fd);
+int  event_wait(int timeout_ms, const sigset_t *wait_mask);
+
+#endif
@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+/*
+ * Benchmark of log_info() against the way it used to be written, which
+ * called vsyslog(), then vfprintf() and fprintf() for the newline.  Standard
+ * output is line buffered, as on a terminal, so the old version makes one
+ * write per line too, on top of the stdio lock and formatting the message a
+ * second time.  Results are written as CSV with the cost of a line in
+ * nanoseconds.
+ *
+ * Neither version sends to syslog.  Without a syslog daemon the old version
+ * tries to connect on every line while the new one tries once a second, and
+ * with one, the cost depends on how fast it reads.  Either way that would
+ * not compare formatting and the terminal write like for like.
+ */
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * The previous log_info(), less its vsyslog()
+ */
+static void old_log_info(char *format, ...) {
+    va_list vargs;
+
+    va_start(vargs, format);
+    vfprintf(stdout, format, vargs);
+    fprintf(stdout, "\n");
+    va_end(vargs);
+}
+
+/*
+ * Parse the number of lines to log.  Returns -1 if the argument is not a
+ * number or out of range.
+ */
+static long parse_lines(const char *arg) {
+    char *end;
+
+    errno = 0;
+    long value = strtol(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || value < 1
+        || value > 1000000000)
+        return -1;
+    return value;
+}
+
+void usage(char **argv) {
+    printf("Usage: %s [OPTIONS]\n\n", argv[0]);
+    printf("  -n, --lines       Number of lines logged by each version\n");
+    printf("                    Default is 1000000\n");
+    printf("  -o, --output      File that receives the log lines\n");
+    printf("                    Default is /dev/null\n");
+    printf("  -h, --help        These usage instructions\n\n");
+}
+
+int main(int argc, char **argv) {
+    char *output = "/dev/null";
+    long lines = 1000000;
+
+    static struct option long_options[] = {
+        {"lines",  required_argument, 0, 'n'},
+        {"output", required_argument, 0, 'o'},
+        {"help",   no_argument,       0, 'h'},
+        {0,        0,                 0,  0}
+    };
+
+    while (1) {
+        int c = getopt_long(argc, argv, "n:o:h", long_options, 0);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'n' :
+            lines = parse_lines(optarg);
+            break;
+
+        case 'o' :
+            output = optarg;
+            break;
+
+        case 'h' :
+        default:
+            usage(argv);
+            exit(0);
+        }
+    }
+
+    if (lines < 1) {
+        usage(argv);
+        exit(1);
+    }
+
+    /*
+     * log lines go to standard output, so keep a copy of it for the results
+     */
+    int results_fd = dup(STDOUT_FILENO);
+    int output_fd = open(output, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (results_fd == -1 || output_fd == -1
+        || dup2(output_fd, STDOUT_FILENO) == -1) {
+        perror("log-bench: unable to redirect standard output");
+        exit(1);
+    }
+    close(output_fd);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    log_set_syslog(0);
+
+    long start = now_ns();
+    for (long i = 0; i < lines; i++)
+        old_log_info("tick, cpu %.1f%% wait %.1f%% csw %d/s rss %ld kB",
+            0.1, 0.0, 10, i);
+    long old_ns = now_ns() - start;
+
+    start = now_ns();
+    for (long i = 0; i < lines; i++)
+        log_info("tick, cpu %.1f%% wait %.1f%% csw %d/s rss %ld kB",
+            0.1, 0.0, 10, i);
+    long new_ns = now_ns() - start;
+
+    dprintf(results_fd, "implementation,lines,ns_per_line\n");
+    dprintf(results_fd, "stdio,%ld,%.1f\n", lines, (double)old_ns / lines);
+    dprintf(results_fd, "single_write,%ld,%.1f\n", lines, (double)new_ns / lines);
+    return 0;
+}
@@ -0,0 +1,293 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "logfile.h"
+#include "util.h"
+
+/*
+ * A segment is a pre-sized file that is mapped into memory.  Log records are
+ * appended by reserving space with a single atomic add on the cursor and then
+ * copying the record into the mapping, so no system call is made per line.
+ * The unused tail of a segment is zero filled, which lets tools like "tail"
+ * or "less" read a live segment directly from the page cache.
+ */
+struct segment {
+    int    fd;
+    char   *base;
+    size_t cursor;
+    size_t valid_end;            // end of the last record that fit, once full
+    char   filename[PATH_MAX];
+};
+
+static char   segment_base[PATH_MAX];
+static size_t segment_size;
+static unsigned int next_number;
+
+/*
+ * Two segments alternate.  While one is current, the other is allocated ahead
+ * of time so that rotation only has to swap them.
+ */
+static struct segment segments[2];
+static int current = -1;         // index of the current segment, -1 if closed
+static int next_ready = 0;       // segments[!current] is mapped and ready
+
+/*
+ * Why the last rotation failed, or 0.  Rotation creates files as whatever
+ * user the daemon runs as by then, which may not be allowed to.
+ */
+static int stopped_errno = 0;
+static int stop_reported = 0;
+
+/*
+ * Segments are named <base_name>.NNNN.  Find the highest number already used
+ * so that restarting the daemon never overwrites older segments.
+ */
+static unsigned int find_next_number() {
+    char dir_copy[PATH_MAX], name_copy[PATH_MAX];
+    unsigned int highest = 0;
+    int found = 0;
+
+    strcpy(dir_copy, segment_base);
+    strcpy(name_copy, segment_base);
+    char *dir = dirname(dir_copy);
+    char *name = basename(name_copy);
+    size_t name_len = strlen(name);
+
+    DIR *dir_list = opendir(dir);
+    if (!dir_list)
+        return 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir_list)) != NULL) {
+        char *end;
+
+        if (strncmp(entry->d_name, name, name_len) != 0
+            || entry->d_name[name_len] != '.')
+            continue;
+
+        unsigned long number = strtoul(entry->d_name + name_len + 1, &end, 10);
+        if (*end == '\0' && end != entry->d_name + name_len + 1
+            && (!found || number > highest)) {
+            highest = number;
+            found = 1;
+        }
+    }
+    closedir(dir_list);
+
+    return found ? highest + 1 : 0;
+}
+
+/*
+ * Create the next segment file, reserve its blocks with fallocate() so later
+ * page faults never have to allocate disk space, and map it.
+ */
+static int prepare_segment(struct segment *seg) {
+    int len = snprintf(seg->filename, PATH_MAX, "%s.%04u", segment_base,
+        next_number);
+    if (len < 0 || len >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    seg->fd = open(seg->filename, O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC,
+        S_IRUSR | S_IWUSR | S_IRGRP);
+    if (seg->fd == -1)
+        return -1;
+
+    /* not every filesystem supports fallocate(), so fall back to ftruncate() */
+    if (fallocate(seg->fd, 0, 0, segment_size) == -1
+        && ftruncate(seg->fd, segment_size) == -1) {
+        close(seg->fd);
+        unlink(seg->filename);
+        return -1;
+    }
+
+    seg->base = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        seg->fd, 0);
+    if (seg->base == MAP_FAILED) {
+        close(seg->fd);
+        unlink(seg->filename);
+        return -1;
+    }
+
+    seg->cursor = 0;
+    seg->valid_end = SIZE_MAX;
+    next_number++;
+    return 0;
+}
+
+/*
+ * Bytes of a segment holding records.  Once a reservation crossed the end of
+ * the segment, that is where the last record that fit ended, not the cursor.
+ */
+static size_t used_bytes(struct segment *seg) {
+    size_t valid_end = __atomic_load_n(&seg->valid_end, __ATOMIC_RELAXED);
+    if (valid_end != SIZE_MAX)
+        return valid_end;
+    return seg->cursor < segment_size ? seg->cursor : segment_size;
+}
+
+/*
+ * Unmap a segment and trim the file to the bytes actually written.  Segments
+ * that never received a record are removed.
+ */
+static void retire_segment(struct segment *seg) {
+    size_t used = used_bytes(seg);
+
+    munmap(seg->base, segment_size);
+    if (used == 0)
+        unlink(seg->filename);
+    else
+        ftruncate(seg->fd, used);
+    close(seg->fd);
+}
+
+/*
+ * Switch to the pre-allocated segment.  If the flush timer has not prepared
+ * one yet, do it now.
+ */
+static void rotate() {
+    int old = current;
+
+    if (!next_ready && prepare_segment(&segments[!old]) == -1) {
+        stopped_errno = errno;
+        current = -1;
+        retire_segment(&segments[old]);
+        return;
+    }
+
+    next_ready = 0;
+    current = !old;
+    retire_segment(&segments[old]);
+}
+
+int logfile_open(const char *base_name, size_t size) {
+    if (current != -1)
+        logfile_close();
+
+    strcpy(segment_base, base_name);
+    segment_size = size;
+    next_number = find_next_number();
+    stopped_errno = stop_reported = 0;
+
+    if (prepare_segment(&segments[0]) == -1)
+        return -1;
+
+    current = 0;
+    next_ready = (prepare_segment(&segments[1]) == 0);
+    return 0;
+}
+
+int logfile_is_open() {
+    return current != -1;
+}
+
+/*
+ * Append one record.  The atomic add makes the reservation safe even when a
+ * signal handler logs while the main loop is in the middle of a write.  The
+ * writer whose reservation crosses the end of the segment performs the
+ * rotation; a nested writer that lands entirely past the end (only possible
+ * while that rotation is in progress) drops its record.
+ */
+void logfile_write(const char *record, size_t len) {
+    while (current != -1 && len <= segment_size) {
+        struct segment *seg = &segments[current];
+        size_t offset = __atomic_fetch_add(&seg->cursor, len, __ATOMIC_RELAXED);
+
+        if (offset + len <= segment_size) {
+            memcpy(seg->base + offset, record, len);
+            return;
+        }
+
+        if (offset >= segment_size)
+            return;
+
+        /*
+         * reservations are contiguous, so exactly one of them crosses the end
+         * and every record that fit ends at or before its offset
+         */
+        __atomic_store_n(&seg->valid_end, offset, __ATOMIC_RELAXED);
+        rotate();
+    }
+}
+
+/*
+ * After a failed rotation, say why once, and keep trying to start a new
+ * segment.  Meanwhile messages still go to syslog and standard output.
+ */
+static void resume() {
+    if (stopped_errno == 0)
+        return;
+
+    if (!stop_reported) {
+        log_info("Unable to rotate log file %s, logging without it: %s",
+            segment_base, strerror(stopped_errno));
+        stop_reported = 1;
+    }
+
+    if (prepare_segment(&segments[0]) == -1)
+        return;
+
+    current = 0;
+    stopped_errno = stop_reported = 0;
+    log_info("Log file resumed in %s", segments[0].filename);
+}
+
+/*
+ * Called periodically from the main loop.  Schedule write back of the current
+ * segment without waiting for it, and allocate the next segment ahead of time
+ * so rotation stays cheap.
+ */
+void logfile_flush() {
+    if (current == -1) {
+        resume();
+        return;
+    }
+
+    struct segment *seg = &segments[current];
+    size_t used = used_bytes(seg);
+    if (used > 0)
+        msync(seg->base, used, MS_ASYNC);
+
+    if (!next_ready)
+        next_ready = (prepare_segment(&segments[!current]) == 0);
+}
+
+/*
+ * Start a fresh segment, e.g. after an external tool moved the old ones away
+ */
+int logfile_reopen() {
+    if (current == -1 && stopped_errno == 0)
+        return -1;
+
+    char base_name[PATH_MAX];
+    strcpy(base_name, segment_base);
+    return logfile_open(base_name, segment_size);
+}
+
+void logfile_close() {
+    stopped_errno = 0;
+    if (current == -1)
+        return;
+
+    int old = current;
+    current = -1;
+
+    msync(segments[old].base, segment_size, MS_SYNC);
+    retire_segment(&segments[old]);
+    if (next_ready)
+        retire_segment(&segments[!old]);
+    next_ready = 0;
+}
@@ -0,0 +1,18 @@
+#ifndef __LOGFILE_H__
+#define __LOGFILE_H__
+
+#include <stddef.h>
+
+/*
+ * Size of each pre-allocated log segment file
+ */
+#define LOGFILE_SEGMENT_SIZE (4 * 1024 * 1024)
+
+int  logfile_open(const char *base_name, size_t segment_size);
+int  logfile_is_open();
+void logfile_write(const char *record, size_t len);
+void logfile_flush();
+int  logfile_reopen();
+void logfile_close();
+
+#endif
@@ -0,0 +1,357 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logring.h"
+#include "probes.h"
+
+/*
+ * A ring of log records in shared memory.  It is created before forking, so
+ * every descendant inherits the mapping and logs by copying its message into
+ * the ring instead of making system calls.  A separate collector process
+ * drains the ring in order and writes batches to the real destination.
+ *
+ * Writers reserve records without locks using the bounded queue design by
+ * Dmitry Vyukov.  Each record has a sequence number that says whose turn it
+ * is: a writer may fill the record at position pos once its sequence equals
+ * pos, and publishes it by setting the sequence to pos + 1.  The collector
+ * reads it once the sequence is pos + 1 and hands it back to writers for the
+ * next lap by setting it to pos + LOGRING_SLOTS.
+ *
+ * A writer that holds a record too long is given up on, and the record is
+ * handed to the next lap.  So a writer formats its message on its own stack
+ * and only copies it into the record after claiming it, by moving the
+ * sequence from pos to pos - 1.  The claim fails if the record was given up
+ * on.  A claimed record is never given up on, and looks full to writers of
+ * the next lap.
+ *
+ * Each record is tagged with the pid, process group and session of its
+ * writer.  The collector only copies records to standard output if the
+ * writer is still in the collector's session, i.e. it shares the terminal.
+ * Records of a daemon that detached go to syslog only.
+ */
+
+/*
+ * How often the collector drains the ring
+ */
+#define LOGRING_BATCH_MS 50
+
+/*
+ * A writer that reserved a record but has not published it after this long
+ * is assumed to have died, and the record is skipped
+ */
+#define LOGRING_STALL_MS 1000
+
+struct record {
+    uint64_t sequence;
+    int32_t  priority;
+    int32_t  pid;
+    int32_t  pgid;
+    int32_t  sid;
+    uint32_t len;
+    char     text[LOGRING_TEXT_MAX];
+};
+
+struct ring {
+    uint64_t      head;           // next position writers reserve
+    uint64_t      overflows;      // messages that did not fit
+    uint64_t      skipped;        // records abandoned by their writer
+    struct record records[LOGRING_SLOTS];
+};
+
+static struct ring *ring;         // NULL until logring_create()
+static int alive_fd = -1;         // write end of the liveness pipe, held
+                                  // open by every writer until it exits
+
+/*
+ * Identity of this process, so that it is not looked up for every message.
+ * Reset in the child after fork() and by logring_refresh() after setsid().
+ */
+static pid_t cached_pid, cached_pgid, cached_sid;
+
+void logring_refresh() {
+    cached_pid = 0;
+}
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Write out everything buffered for standard output
+ */
+static void flush_output(char *out, size_t *used) {
+    size_t done = 0;
+
+    while (done < *used) {
+        ssize_t count = write(STDOUT_FILENO, out + done, *used - done);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;
+        done += count;
+    }
+    *used = 0;
+}
+
+/*
+ * Copy every published record to the sinks.  Standard output is written in
+ * as few calls as possible.
+ */
+static void drain(int sinks, pid_t my_sid, uint64_t *tail, long *stalled_since) {
+    static char out[64 * 1024];
+    size_t used = 0;
+
+    while (1) {
+        struct record *rec = &ring->records[*tail & (LOGRING_SLOTS - 1)];
+        uint64_t sequence = __atomic_load_n(&rec->sequence, __ATOMIC_ACQUIRE);
+
+        if (sequence != *tail + 1) {
+            uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            /* nothing reserved yet, or claimed and being filled */
+            if (sequence != *tail || head <= *tail)
+                break;
+
+            /* reserved but not yet published */
+            if (*stalled_since == 0)
+                *stalled_since = now_ms();
+            if (now_ms() - *stalled_since < LOGRING_STALL_MS)
+                break;
+
+            uint64_t expected = *tail;
+            if (__atomic_compare_exchange_n(&rec->sequence, &expected,
+                    *tail + LOGRING_SLOTS, 0, __ATOMIC_ACQ_REL,
+                    __ATOMIC_ACQUIRE)) {
+                __atomic_fetch_add(&ring->skipped, 1, __ATOMIC_RELAXED);
+                (*tail)++;
+            }
+            *stalled_since = 0;
+            continue;
+        }
+        *stalled_since = 0;
+
+        if (sinks & LOGRING_SYSLOG)
+            syslog(rec->priority, "[%05d %05d %05d] %.*s", rec->pid, rec->pgid,
+                rec->sid, (int)rec->len, rec->text);
+
+        if ((sinks & LOGRING_STDOUT) && rec->sid == my_sid) {
+            if (sizeof(out) - used < LOGRING_TEXT_MAX + 32)
+                flush_output(out, &used);
+            used += snprintf(out + used, sizeof(out) - used,
+                "[%05d %05d %05d] %.*s\n", rec->pid, rec->pgid, rec->sid,
+                (int)rec->len, rec->text);
+        }
+
+        __atomic_store_n(&rec->sequence, *tail + LOGRING_SLOTS,
+            __ATOMIC_RELEASE);
+        (*tail)++;
+    }
+
+    flush_output(out, &used);
+}
+
+/*
+ * Main loop of the collector.  Every writer holds the write end of a pipe,
+ * so once all of them have exited the read end reports a hang up, and the
+ * collector does a final drain and exits.
+ */
+static void collect(int alive_rd, int sinks) {
+    uint64_t tail = 0;
+    long stalled_since = 0;
+    pid_t my_sid = getsid(0);
+
+    /*
+     * CTRL-C or a terminal hang up must not cut off the log of processes
+     * that survive it
+     */
+    signal(SIGINT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    prctl(PR_SET_NAME, "log-collector");
+
+    while (1) {
+        struct pollfd alive = { alive_rd, POLLIN, 0 };
+
+        int rc = poll(&alive, 1, LOGRING_BATCH_MS);
+        drain(sinks, my_sid, &tail, &stalled_since);
+
+        if (rc > 0 && (alive.revents & (POLLHUP | POLLERR)))
+            break;
+    }
+
+    uint64_t lost = ring->overflows + ring->skipped;
+    if (lost > 0)
+        syslog(LOG_WARNING, "log ring lost %llu records",
+            (unsigned long long)lost);
+    _exit(0);
+}
+
+/*
+ * Create the ring and fork the collector.  Call this before forking any
+ * process that should log through the ring.
+ */
+int logring_create(int sinks) {
+    int alive[2];
+
+    ring = mmap(NULL, sizeof(struct ring), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        ring = NULL;
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < LOGRING_SLOTS; i++)
+        ring->records[i].sequence = i;
+
+    if (pipe2(alive, O_CLOEXEC) == -1) {
+        munmap(ring, sizeof(struct ring));
+        ring = NULL;
+        return -1;
+    }
+
+    pid_t pid = fork();
+    PROBE1(fork_return, pid);
+    if (pid == 0) {
+        close(alive[1]);
+        collect(alive[0], sinks);
+    }
+
+    close(alive[0]);
+    if (pid == -1) {
+        close(alive[1]);
+        munmap(ring, sizeof(struct ring));
+        ring = NULL;
+        return -1;
+    }
+
+    alive_fd = alive[1];
+    pthread_atfork(NULL, NULL, logring_refresh);
+    return 0;
+}
+
+int logring_active() {
+    return ring != NULL;
+}
+
+/*
+ * Stop logging through the ring and log directly from now on.  This lets go
+ * of the liveness pipe, so once every other writer is gone the collector does
+ * its final drain and exits, instead of outliving them in their session.
+ */
+void logring_detach() {
+    if (ring == NULL)
+        return;
+
+    close(alive_fd);
+    alive_fd = -1;
+    munmap(ring, sizeof(struct ring));
+    ring = NULL;
+}
+
+/*
+ * Reserve the next free record, or return NULL if the ring is full
+ */
+static struct record *reserve(uint64_t *pos_out) {
+    if (cached_pid == 0) {
+        cached_pid = getpid();
+        cached_pgid = getpgrp();
+        cached_sid = getsid(0);
+    }
+
+    struct record *rec;
+    uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    while (1) {
+        rec = &ring->records[pos & (LOGRING_SLOTS - 1)];
+        uint64_t sequence = __atomic_load_n(&rec->sequence, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(sequence - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_fetch_add(&ring->overflows, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+
+    *pos_out = pos;
+    return rec;
+}
+
+/*
+ * Claim a reserved record, fill and tag it, and hand it to the collector.
+ * This only fails if the collector gave up on the record because the writer
+ * took too long, in which case nothing is written to it.
+ */
+static int publish(struct record *rec, uint64_t pos, int priority,
+    const char *text, size_t len) {
+    uint64_t expected = pos;
+    if (!__atomic_compare_exchange_n(&rec->sequence, &expected, pos - 1, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return -1;
+
+    rec->priority = priority;
+    rec->pid = cached_pid;
+    rec->pgid = cached_pgid;
+    rec->sid = cached_sid;
+    rec->len = len;
+    memcpy(rec->text, text, len);
+
+    __atomic_store_n(&rec->sequence, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Format a message and put it into the next free record.  Returns -1 if there
+ * is no ring or no free record, in which case the caller should log the
+ * message some other way.
+ */
+int logring_vwrite(int priority, const char *format, va_list vargs) {
+    char text[LOGRING_TEXT_MAX];
+    uint64_t pos;
+    struct record *rec;
+
+    if (ring == NULL)
+        return -1;
+
+    int len = vsnprintf(text, sizeof(text), format, vargs);
+    if (len < 0)
+        len = 0;
+    else if (len >= (int)sizeof(text))
+        len = sizeof(text) - 1;
+
+    if ((rec = reserve(&pos)) == NULL)
+        return -1;
+    return publish(rec, pos, priority, text, len);
+}
+
+/*
+ * Same as logring_vwrite() for a message that is already formatted
+ */
+int logring_write(int priority, const char *text, size_t len) {
+    uint64_t pos;
+    struct record *rec;
+
+    if (ring == NULL || (rec = reserve(&pos)) == NULL)
+        return -1;
+
+    if (len > LOGRING_TEXT_MAX - 1)
+        len = LOGRING_TEXT_MAX - 1;
+    return publish(rec, pos, priority, text, len);
+}
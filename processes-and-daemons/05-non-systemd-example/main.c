@@ -1,19 +1,35 @@
 #define _GNU_SOURCE
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <paths.h>
 #include <pwd.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <syslog.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
 #include <sys/resource.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "control.h"
+#include "event.h"
+#include "logfile.h"
+#include "logring.h"
+#include "monitor.h"
+#include "probes.h"
+#include "psi.h"
+#include "shutdown.h"
+#include "spawn.h"
+#include "state.h"
+#include "timer.h"
 #include "util.h"
 
 extern char **environ;
@@ -21,7 +37,66 @@ extern char **environ;
 /*
  * Flag to keep daemon running. Set to zero on receive of SIGTERM
  */
-static int running = 1;
+static volatile sig_atomic_t running = 1;
+
+/*
+ * Time between ticks of the main loop.  This doubles with every load shedding
+ * level while the system is under pressure.
+ */
+#define TICK_MS 2000
+
+/*
+ * Log level asked for by the operator.  Debug messages are dropped while
+ * shedding load regardless.
+ */
+static int requested_log_level = LOG_INFO;
+
+/*
+ * Budget for a graceful shutdown.  The shutdown control command sets it to
+ * zero so every drain hook gets a single chance before being forced.
+ */
+static long stop_timeout_ms = SHUTDOWN_DEFAULT_BUDGET_MS;
+
+/*
+ * Statistics reported through the control socket
+ */
+static long ticks = 0;
+static long started_ms;
+
+/*
+ * State carried over from one run of the daemon to the next through the
+ * state file.  Bump STATE_VERSION when changing this, since state saved with
+ * a different version is ignored.
+ */
+#define STATE_VERSION 1
+
+struct daemon_state {
+    uint64_t starts;          // times the daemon has started
+    uint64_t crashes;         // starts after a predecessor that did not exit
+    uint64_t total_ticks;     // ticks across all runs
+    uint32_t running;         // cleared on a clean exit
+    uint32_t unused;
+};
+
+static struct daemon_state state;
+
+/*
+ * What main() was asked to run, with full paths since the daemon changes
+ * directory to /.  Paths are NULL when not asked for.
+ */
+static int  daemon_mode = 0;
+static int  zygote_mode = 0;
+static char *pidfile_path;
+static char *logfile_path;
+static char *socket_path;
+
+/*
+ * Start up status the daemon sends its original parent, see Item 14
+ */
+struct start_status {
+    char result;              // '0' on success, otherwise the failed step
+    int  error;               // errno of the failure
+};
 
 /*
  * Minimal environment variable list. Some system calls require PATH
@@ -98,7 +173,9 @@ static void check_if_running(char *lock_filename) {
     fl.l_len = 0;
     fl.l_pid = 0;
 
-    if (fcntl(lock_fd, F_OFD_SETLK, &fl) == -1)
+    int rc = fcntl(lock_fd, F_OFD_SETLK, &fl);
+    PROBE2(lock_acquire, lock_fd, rc);
+    if (rc == -1)
         die(__LINE__, "lock failed due to possible other instance running");
 }
 
@@ -156,12 +233,109 @@ static void reset_all_signal_handlers() {
     for (int i = 1; i < _NSIG; i++)
         signal(i, SIG_DFL);
 
-    /* unblock all signals */
+    /* unblock all signals, which is Item 3 */
+    PROBE2(daemon_item, 3, 0);
     sigset_t signal_set;
     sigemptyset(&signal_set);
     sigprocmask(SIG_SETMASK, &signal_set, NULL);
 }
 
+/*
+ * Warm restart from the state left by the previous daemon, which lives next
+ * to the pid file and is kept when the daemon exits.  The lock file
+ * guarantees the previous daemon is gone.  A state file that cannot be used
+ * only means starting cold.
+ */
+static void open_state() {
+    char state_file[PATH_MAX];
+    int len = snprintf(state_file, PATH_MAX, "%s.state", pidfile_path);
+    if (len < 0 || len >= PATH_MAX) {
+        log_info("State file name for %s is too long, starting cold",
+            pidfile_path);
+        return;
+    }
+
+    switch (state_open(state_file, STATE_VERSION, &state, sizeof(state))) {
+    case -1 :
+        log_info("Unable to use state file %s, starting cold", state_file);
+        break;
+
+    case 0 :
+        log_info("No previous state, starting cold");
+        break;
+
+    default :
+        if (state.running)
+            state.crashes++;
+        log_info("Adopted state of %s predecessor after %llu ticks",
+            state.running ? "crashed" : "cleanly exited",
+            (unsigned long long)state.total_ticks);
+    }
+
+    state.starts++;
+    state.running = 1;
+    state_commit(&state);
+}
+
+/*
+ * Log why start up failed without losing errno for the original parent
+ */
+static int start_failed(const char *what, const char *path) {
+    int error = errno;
+    log_info("Unable to %s %s: %s", what, path, strerror(error));
+    errno = error;
+    return -1;
+}
+
+/*
+ * Open every external communication channel: the event loop that serves
+ * them, the local log file, the state file, and the control socket.  This
+ * happens before privileges are dropped, since these may live in directories
+ * only root can write to, like /run, and before the original parent is told
+ * the daemon is ready.  The control socket is handed to owner and group, the
+ * user the daemon is about to run as, so that user can still connect.
+ */
+static int open_channels(uid_t owner, gid_t group) {
+    started_ms = monotonic_ms();
+    if (event_init() == -1)
+        return start_failed("create", "event loop");
+
+    /*
+     * once detached, standard output goes to /dev/null, so the log file is
+     * the only local copy of the log
+     */
+    if (logfile_path && logfile_open(logfile_path, LOGFILE_SEGMENT_SIZE) == -1)
+        return start_failed("open log file", logfile_path);
+
+    if (daemon_mode)
+        open_state();
+
+    if (socket_path && (control_open(socket_path) == -1
+                        || chown(socket_path, owner, group) == -1))
+        return start_failed("open control socket", socket_path);
+
+    return 0;
+}
+
+/*
+ * Start helper processes, which run with the privileges of the daemon.  The
+ * spawn server is forked before the daemon grows, and closes the descriptors
+ * it inherits.
+ */
+static int start_helpers() {
+    if (zygote_mode && spawn_server_start() == -1)
+        return start_failed("start", "spawn server");
+    return 0;
+}
+
+/*
+ * Tell the original parent how start up went.  On failure, errno says why.
+ */
+static void report_start(int pipe_fd, char result) {
+    struct start_status status = { result, result == '0' ? 0 : errno };
+    write(pipe_fd, &status, sizeof(status));
+}
+
 /*
  * This complies with "man 7 daemon" for SysV daemons
  */
@@ -176,8 +350,18 @@ static void make_daemon(char *lock_filename, char *pid_filename,
      * with a fallback of iterating from file descriptor 3 to the value
      * returned by getrlimit() for RLIMIT_NOFILE.
      */
+    PROBE2(daemon_item, 1, 0);
+    log_reopen();
     close_all_fds();
 
+    /*
+     * Create a log ring in shared memory, with a collector process that
+     * drains it, before any fork().  The parent, the first child, and the
+     * daemon then all log through it, and their messages come out in order
+     * instead of interleaved.  If this fails, each process logs directly.
+     */
+    logring_create(LOGRING_STDOUT | LOGRING_SYSLOG);
+
     /*
      * Item 12 check for exclusivity
      * Make sure that the daemon PID can be written to a PID file to ensure
@@ -186,6 +370,7 @@ static void make_daemon(char *lock_filename, char *pid_filename,
      * when it is verified at the same time that the PID previously stored in
      * the PID file no longer exists or belongs to a foreign process.
      */
+    PROBE2(daemon_item, 12, 1);
     check_if_running(lock_filename);
 
     /*
@@ -196,6 +381,7 @@ static void make_daemon(char *lock_filename, char *pid_filename,
      *
      * Reset the signal mask using sigprocmask().
      */
+    PROBE2(daemon_item, 2, 0);
     reset_all_signal_handlers();
 
     /*
@@ -203,6 +389,7 @@ static void make_daemon(char *lock_filename, char *pid_filename,
      * Sanitize the environment block, removing or resetting environment
      * variables that might negatively impact daemon runtime.
      */
+    PROBE2(daemon_item, 4, 0);
     sanitize_env();
 
     /*
@@ -210,6 +397,7 @@ static void make_daemon(char *lock_filename, char *pid_filename,
      * Open an unnamed pipe for the child to communicate start up status to the
      * parent. pipefd[0] is the read end and pipefd[1] is the write end
      */
+    PROBE2(daemon_item, 14, 1);
     int pipefd[2];
     if (pipe(pipefd) == -1)
         die(__LINE__, "failed to open pipe");
@@ -218,7 +406,9 @@ static void make_daemon(char *lock_filename, char *pid_filename,
      * Item 5
      * Call fork(), to create a background process.
      */
+    PROBE2(daemon_item, 5, 0);
     pid_t pid = fork();
+    PROBE1(fork_return, pid);
     if (pid == -1)
         die(__LINE__, "parent failed to fork");
     else if (pid > 0) {
@@ -235,9 +425,10 @@ static void make_daemon(char *lock_filename, char *pid_filename,
         /*
          * wait for status from the daemon process
          */
-        char result;
+        struct start_status status;
 
-        if (read(pipefd[0], &result, 1) == -1)
+        ssize_t count = read(pipefd[0], &status, sizeof(status));
+        if (count == -1)
             die(__LINE__, "unable to read the pipe");
 
         /*
@@ -252,10 +443,14 @@ static void make_daemon(char *lock_filename, char *pid_filename,
          * initialization is complete and all external communication channels
          * are established and accessible.
          */
-        if (result == '0')
+        PROBE2(daemon_item, 15, 0);
+        if (count != sizeof(status))
+            die(__LINE__, "daemon exited during start up");
+        else if (status.result == '0')
             exit(EXIT_SUCCESS);
         else
-            die(__LINE__, "daemon failed at %c", result);
+            die(__LINE__, "daemon failed at %c: %s", status.result,
+                strerror(status.error));
     } else {
         /*
          * We're the first child process
@@ -272,19 +467,23 @@ static void make_daemon(char *lock_filename, char *pid_filename,
          * Item 6
          * Detach from any terminal and create an independent session
          */
+        PROBE2(daemon_item, 6, 0);
         if (setsid() == -1) {
-            write(pipefd[1], "1", 1);
+            report_start(pipefd[1], '1');
             exit(EXIT_FAILURE);
         }
+        logring_refresh();
 
         /*
          * Item 7
          * Call fork() again to ensure that the daemon can never re-acquire a
          * terminal again
          */
+        PROBE2(daemon_item, 7, 0);
         pid = fork();
+        PROBE1(fork_return, pid);
         if (pid == -1) {
-            write(pipefd[1], "2", 1);
+            report_start(pipefd[1], '2');
             exit(EXIT_FAILURE);
         } else if (pid > 0) {
             /*
@@ -297,6 +496,7 @@ static void make_daemon(char *lock_filename, char *pid_filename,
              * daemon process) stays around.  This ensures that the daemon
              * process is re-parented to PID 1, as all daemons should be.
              */
+            PROBE2(daemon_item, 8, 0);
             exit(EXIT_SUCCESS);
         } else {
             /*
@@ -309,22 +509,23 @@ static void make_daemon(char *lock_filename, char *pid_filename,
              * Item 9
              * Connect /dev/null to standard input, output, and error
              */
+            PROBE2(daemon_item, 9, 0);
 
             for (int i = 0; i < 3; i++)
                 close(i);
 
             if (open("/dev/null", O_RDWR) == -1) {
-                write(pipefd[1], "3", 1);
+                report_start(pipefd[1], '3');
                 exit(EXIT_FAILURE);
             }
 
             if (dup(0) == -1) {
-                write(pipefd[1], "4", 1);
+                report_start(pipefd[1], '4');
                 exit(EXIT_FAILURE);
             }
 
             if (dup(0) == -1) {
-                write(pipefd[1], "5", 1);
+                report_start(pipefd[1], '5');
                 exit(EXIT_FAILURE);
             }
             
@@ -334,6 +535,7 @@ static void make_daemon(char *lock_filename, char *pid_filename,
              * mkdir() and suchlike directly control the access mode of the
              * created files and directories.
              */
+            PROBE2(daemon_item, 10, 0);
             umask(0);
 
             /*
@@ -342,8 +544,9 @@ static void make_daemon(char *lock_filename, char *pid_filename,
              * to avoid that the daemon involuntarily blocks the mount points
              * from being unmounted.
              */
+            PROBE2(daemon_item, 11, 0);
             if (chdir ("/") == -1) {
-                write(pipefd[1], "6", 1);
+                report_start(pipefd[1], '6');
                 exit(EXIT_FAILURE);
             }
 
@@ -353,47 +556,86 @@ static void make_daemon(char *lock_filename, char *pid_filename,
              * for example /run/foobar.pid (for a hypothetical daemon "foobar")
              * to ensure that the daemon cannot  be started more than once.
              */
+            PROBE2(daemon_item, 12, 2);
             FILE *pid_file = NULL;
 
             pid_file = fopen(pid_filename, "w");
             if (pid_file == NULL) {
-                write(pipefd[1], "7", 1);
+                report_start(pipefd[1], '7');
                 exit(EXIT_FAILURE);
             }
 
             int rc = fprintf(pid_file, "%d\n", getpid());
             if (rc < 0) {
-                write(pipefd[1], "8", 1);
+                report_start(pipefd[1], '8');
+                unlink(pid_filename);
                 exit(EXIT_FAILURE);
             }
 
             fclose(pid_file);
 
             /*
-             * Item 13
-             * Drop privileges, if possible and applicable
+             * Look up the user to run as, whose privileges are dropped to
+             * below
              */
+            uid_t target_uid = -1;
+            gid_t target_gid = -1;
             if (target_user) {
                 struct passwd *pwd_entry;
                 
                 pwd_entry = getpwnam(target_user);
                 if (pwd_entry == NULL) {
-                    write(pipefd[1], "9", 1);
+                    report_start(pipefd[1], '9');
+                    unlink(pid_filename);
                     exit(EXIT_FAILURE);
                 }
 
-                if (setuid(pwd_entry->pw_uid) == -1) {
-                    write(pipefd[1], "A", 1);
-                    exit(EXIT_FAILURE);
-                }
+                target_uid = pwd_entry->pw_uid;
+                target_gid = pwd_entry->pw_gid;
+            }
+
+            /*
+             * Item 15 asks that all external communication channels are
+             * established before the original parent exits, so open them now,
+             * while the daemon still has the privileges to create them
+             */
+            if (open_channels(target_uid, target_gid) == -1) {
+                report_start(pipefd[1], 'B');
+                unlink(pid_filename);
+                exit(EXIT_FAILURE);
+            }
+
+            /*
+             * Item 13
+             * Drop privileges, if possible and applicable
+             */
+            PROBE2(daemon_item, 13, 0);
+            if (target_user && setuid(target_uid) == -1) {
+                report_start(pipefd[1], 'A');
+                unlink(pid_filename);
+                exit(EXIT_FAILURE);
+            }
+
+            if (start_helpers() == -1) {
+                report_start(pipefd[1], 'C');
+                unlink(pid_filename);
+                exit(EXIT_FAILURE);
             }
 
             /*
              * Item 14
              * notify the original parent that initialization is complete.
              */
-            write(pipefd[1], "0", 2);
+            PROBE2(daemon_item, 14, 2);
+            report_start(pipefd[1], '0');
             close(pipefd[1]);
+
+            /*
+             * the collector was forked before setsid(), so it still belongs
+             * to the terminal's session.  Once the original parent has exited
+             * nothing else logs through the ring, so let the collector go.
+             */
+            logring_detach();
         }
     }
 }
@@ -413,6 +655,262 @@ void handle_signal(int signum) {
      */
 }
 
+/*
+ * Shutdown drain hooks.  The pid file is removed before the log file is
+ * closed so that the log records the whole shutdown.
+ */
+static int remove_pidfile(void *pid_filename) {
+    unlink((char *)pid_filename);
+    return 1;
+}
+
+static int close_logfile(void *unused) {
+    logfile_close();
+    return 1;
+}
+
+/*
+ * Record the clean exit and make sure the final state reaches the disk
+ */
+static int close_state(void *unused) {
+    state.running = 0;
+    state_commit(&state);
+    state_sync();
+    state_close();
+    return 1;
+}
+
+static int close_psi(void *unused) {
+    psi_close();
+    return 1;
+}
+
+static int close_control(void *unused) {
+    control_close();
+    return 1;
+}
+
+static int close_monitor(void *unused) {
+    monitor_close();
+    return 1;
+}
+
+static int close_timers(void *unused) {
+    timer_close();
+    return 1;
+}
+
+static int stop_spawn_server(void *unused) {
+    return spawn_server_stop();
+}
+
+static void kill_spawn_server(void *unused) {
+    spawn_server_kill();
+}
+
+/*
+ * Control socket commands
+ */
+static const char *level_names[] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+static void apply_log_level() {
+    int level = requested_log_level;
+
+    if (psi_level() > 0 && level > LOG_INFO)
+        level = LOG_INFO;
+
+    log_set_level(level);
+}
+
+/*
+ * React to CPU, memory, or I/O pressure by doing less: stretch the tick
+ * period and drop debug logging until the pressure clears
+ */
+static void shed_load(int level) {
+    apply_log_level();
+    log_info("Load shedding level %d, ticking every %d ms", level,
+        TICK_MS << level);
+}
+
+static int stats_command(int argc, char **argv, char *reply,
+    size_t reply_size) {
+    int len = snprintf(reply, reply_size,
+        "pid %d\n"
+        "uptime_ms %ld\n"
+        "ticks %ld\n"
+        "starts %llu\n"
+        "crashes %llu\n"
+        "total_ticks %llu\n"
+        "shed_level %d\n"
+        "tick_ms %d\n"
+        "log_level %s\n"
+        "logfile %s\n"
+        "timers %ld\n",
+        getpid(), monotonic_ms() - started_ms, ticks,
+        (unsigned long long)state.starts, (unsigned long long)state.crashes,
+        (unsigned long long)state.total_ticks,
+        psi_level(), TICK_MS << psi_level(),
+        level_names[log_get_level()],
+        logfile_is_open() ? "open" : "closed",
+        timer_pending());
+
+    if (len > 0 && (size_t)len < reply_size)
+        monitor_report(reply + len, reply_size - len);
+    return 0;
+}
+
+static int loglevel_command(int argc, char **argv, char *reply,
+    size_t reply_size) {
+    if (argc != 2) {
+        snprintf(reply, reply_size, "usage: loglevel err|warning|notice|"
+            "info|debug\n");
+        return -1;
+    }
+
+    for (int level = LOG_ERR; level <= LOG_DEBUG; level++)
+        if (strcmp(argv[1], level_names[level]) == 0) {
+            requested_log_level = level;
+            apply_log_level();
+            return 0;
+        }
+
+    snprintf(reply, reply_size, "unknown log level %s\n", argv[1]);
+    return -1;
+}
+
+/*
+ * Start over with fresh log files, e.g. after logrotate moved them away
+ */
+static int reopen_command(int argc, char **argv, char *reply,
+    size_t reply_size) {
+    log_reopen();
+    if (logfile_is_open() && logfile_reopen() == -1) {
+        snprintf(reply, reply_size, "unable to reopen log file\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Log when a program started with the spawn command exits
+ */
+static void handle_spawned_exit(int pidfd, unsigned int events, void *arg) {
+    log_info("Spawned process %ld exited", (long)arg);
+    event_del(pidfd);
+    close(pidfd);
+}
+
+/*
+ * Run a helper program through the spawn server.  Its standard input, output,
+ * and error are connected to /dev/null.
+ */
+static int spawn_command(int argc, char **argv, char *reply,
+    size_t reply_size) {
+    if (argc < 2) {
+        snprintf(reply, reply_size, "usage: spawn program [arguments]\n");
+        return -1;
+    }
+
+    int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (null_fd == -1) {
+        snprintf(reply, reply_size, "unable to open /dev/null\n");
+        return -1;
+    }
+
+    int fds[3] = { null_fd, null_fd, null_fd };
+    int pidfd;
+    pid_t pid = spawn_process(argv + 1, environ, fds, &pidfd);
+    close(null_fd);
+
+    if (pid == -1) {
+        snprintf(reply, reply_size, "unable to spawn %s: %s\n", argv[1],
+            strerror(errno));
+        return -1;
+    }
+
+    if (pidfd != -1
+        && event_add(pidfd, EPOLLIN, handle_spawned_exit, (void *)(long)pid)
+           == -1)
+        close(pidfd);
+
+    log_info("Spawned %s as process %d", argv[1], pid);
+    snprintf(reply, reply_size, "pid %d\n", pid);
+    return 0;
+}
+
+/*
+ * Exit gracefully, running every shutdown phase within the stop timeout
+ */
+static int drain_command(int argc, char **argv, char *reply,
+    size_t reply_size) {
+    log_info("Draining on request");
+    running = 0;
+    return 0;
+}
+
+/*
+ * Exit now.  Each shutdown phase gets one attempt and is then forced.
+ */
+static int shutdown_command(int argc, char **argv, char *reply,
+    size_t reply_size) {
+    log_info("Shutting down on request");
+    stop_timeout_ms = 0;
+    running = 0;
+    return 0;
+}
+
+static int tick_due;
+
+static void tick_expired(void *unused) {
+    tick_due = 1;
+}
+
+/*
+ * Serve events, like control socket requests, until the tick timer expires or
+ * until the running flag is cleared.  The handled signals are blocked
+ * everywhere except inside the wait, which unblocks them atomically.
+ * Otherwise a SIGTERM arriving just after the loop tested the running flag
+ * would wait out a whole tick.  Other signals, like SIGHUP, do not shorten the
+ * tick.
+ *
+ * If no timer can be allocated, wait for a deadline on the monotonic clock
+ * instead.
+ */
+static void wait_for_tick(const sigset_t *wait_mask) {
+    long period_ms = TICK_MS << psi_level();
+
+    tick_due = 0;
+    if (timer_add(period_ms, tick_expired, NULL) == 0) {
+        log_info("Unable to add the tick timer, waiting for a deadline");
+
+        long deadline = monotonic_ms() + period_ms;
+        long now;
+        while (running == 1 && (now = monotonic_ms()) < deadline)
+            event_wait(deadline - now, wait_mask);
+        return;
+    }
+
+    while (running == 1 && !tick_due)
+        event_wait(-1, wait_mask);
+}
+
+/*
+ * Parse the shutdown timeout in seconds, from 0 up to a day.  Returns it in
+ * milliseconds, or -1 if it is not a number or out of range.
+ */
+static long parse_timeout(const char *arg) {
+    char *end;
+
+    errno = 0;
+    long seconds = strtol(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || seconds < 0
+        || seconds > 24 * 60 * 60)
+        return -1;
+    return seconds * 1000;
+}
+
 void usage(char **argv) {
     printf("Usage: %s [OPTIONS]\n\n", argv[0]);
     printf("  -d, --daemon      Run process as a SysV-style daemon\n");
@@ -420,6 +918,18 @@ void usage(char **argv) {
     printf("                    Default is /run/lock/%s.lock\n", argv[0]);
     printf("  -p, --pidfile     File to save the daemon pid\n");
     printf("                    Default is /run/%s.pid\n", argv[0]);
+    printf("  -f, --logfile     Base name for memory-mapped log segment files\n");
+    printf("                    Default is no local log file\n");
+    printf("  -t, --timeout     Seconds allowed for a graceful shutdown\n");
+    printf("                    Default is %d, keep it a few seconds below\n",
+        SHUTDOWN_DEFAULT_BUDGET_MS / 1000);
+    printf("                    TimeoutStopSec\n");
+    printf("  -s, --socket      Control socket for runtime commands\n");
+    printf("                    Default is no control socket\n");
+    printf("  -r, --pressure    Pressure file to watch, e.g. a fake one to test\n");
+    printf("                    Default is this cgroup's or /proc/pressure\n");
+    printf("  -z, --zygote      Start helper programs from a small spawn server\n");
+    printf("                    forked early, instead of forking the daemon\n");
     printf("  -u, --user        User name for daemon to run as\n");
     printf("                    Default is $SUDO_USER, otherwise $USER\n",
         argv[0]);
@@ -433,8 +943,10 @@ int main (int argc, char **argv)
 
     char pidfile[PATH_MAX];
     char lockfile[PATH_MAX];
+    char logfile[PATH_MAX];
+    char socket_file[PATH_MAX];
+    char pressure_file[PATH_MAX];
     char *user    = 0;
-    int  daemon_mode = 0;
 
     /*
      * set reasonable defaults for arguments for when daemon_mode is true
@@ -445,6 +957,9 @@ int main (int argc, char **argv)
      */
     memset(pidfile, 0, PATH_MAX);
     memset(lockfile, 0, PATH_MAX);
+    memset(logfile, 0, PATH_MAX);
+    memset(socket_file, 0, PATH_MAX);
+    memset(pressure_file, 0, PATH_MAX);
 
     sprintf(pidfile, "%s%s.pid", default_pid_dir, argv[0]);
     sprintf(lockfile, "%s%s.lock", default_lock_dir, argv[0]);
@@ -462,13 +977,18 @@ int main (int argc, char **argv)
         {"daemon",   no_argument,       0, 'd'},
         {"lockfile", required_argument, 0, 'l'},
         {"pidfile",  required_argument, 0, 'p'},
+        {"logfile",  required_argument, 0, 'f'},
+        {"timeout",  required_argument, 0, 't'},
+        {"socket",   required_argument, 0, 's'},
+        {"pressure", required_argument, 0, 'r'},
+        {"zygote",   no_argument,       0, 'z'},
         {"user",     required_argument, 0, 'u'},
         {"help",     no_argument,       0, 'h'},
         {0,          0,                 0,  0}
     };
 
     while (1) {
-        int c = getopt_long(argc, argv, "dl:p:u:h", long_options, 0);
+        int c = getopt_long(argc, argv, "dl:p:f:t:s:r:zu:h", long_options, 0);
         if (c == -1)
             break;
 
@@ -485,6 +1005,31 @@ int main (int argc, char **argv)
             strcpy(pidfile, optarg);
             break;
 
+        case 'f' :
+            strcpy(logfile, optarg);
+            break;
+
+        case 't' :
+            stop_timeout_ms = parse_timeout(optarg);
+            if (stop_timeout_ms == -1) {
+                fprintf(stderr, "Invalid timeout: %s\n\n", optarg);
+                usage(argv);
+                exit(1);
+            }
+            break;
+
+        case 's' :
+            strcpy(socket_file, optarg);
+            break;
+
+        case 'r' :
+            strcpy(pressure_file, optarg);
+            break;
+
+        case 'z' :
+            zygote_mode = 1;
+            break;
+
         case 'u' :
             user = optarg;
             break;
@@ -509,19 +1054,93 @@ int main (int argc, char **argv)
      */
     char actual_lockfile[PATH_MAX];
     char actual_pidfile[PATH_MAX];
+    char actual_logfile[PATH_MAX];
+    char actual_socket_file[PATH_MAX];
+    char actual_pressure_file[PATH_MAX];
 
     realpath(lockfile, actual_lockfile);
     realpath(pidfile, actual_pidfile);
+    pidfile_path = actual_pidfile;
+    if (logfile[0] != '\0') {
+        realpath(logfile, actual_logfile);
+        logfile_path = actual_logfile;
+    }
+    if (socket_file[0] != '\0') {
+        realpath(socket_file, actual_socket_file);
+        socket_path = actual_socket_file;
+    }
+    if (pressure_file[0] != '\0')
+        realpath(pressure_file, actual_pressure_file);
 
     /*
-     * daemonize the process
+     * daemonize the process.  Otherwise, open what make_daemon() would have.
      */
     if (daemon_mode)
         make_daemon(actual_lockfile, actual_pidfile, user);
+    else if (open_channels(-1, -1) == -1 || start_helpers() == -1)
+        die(__LINE__, "unable to start: %s", strerror(errno));
+
+    /*
+     * the tick, and any other timeout, is scheduled on a timing wheel that
+     * is driven by a single timerfd in the event loop
+     */
+    if (timer_open() == -1)
+        die(__LINE__, "unable to create timer");
+
+    /*
+     * sample our own scheduling delays, context switches, and faults
+     */
+    if (monitor_open() == -1)
+        log_info("Unable to monitor this process");
+
+    /*
+     * back off when the system, or this cgroup, is short on CPU, memory, or
+     * I/O
+     */
+    int pressure_files = psi_open(
+        pressure_file[0] != '\0' ? actual_pressure_file : NULL, shed_load);
+    log_info("Watching %d pressure files", pressure_files);
+
+    if (socket_path) {
+        control_register("stats", "Report daemon statistics", stats_command);
+        control_register("loglevel", "Set the log level, e.g. loglevel debug",
+            loglevel_command);
+        control_register("reopen", "Reopen the log files", reopen_command);
+        if (zygote_mode)
+            control_register("spawn", "Run a program, e.g. spawn /bin/true",
+                spawn_command);
+        control_register("drain", "Shut down gracefully", drain_command);
+        control_register("shutdown", "Shut down without waiting to drain",
+            shutdown_command);
+    }
+
+    /*
+     * register what must be cleaned up on the way out.  The control socket
+     * goes first so no new requests arrive while the rest drains.
+     */
+    shutdown_register("control", 10, 1000, close_control, NULL, NULL);
+    shutdown_register("spawn", 20, 1000, stop_spawn_server, kill_spawn_server,
+        NULL);
+    shutdown_register("pressure", 30, 1000, close_psi, NULL, NULL);
+    shutdown_register("state", 40, 1000, close_state, NULL, NULL);
+    if (daemon_mode)
+        shutdown_register("pidfile", 50, 1000, remove_pidfile, NULL,
+            actual_pidfile);
+    shutdown_register("monitor", 60, 1000, close_monitor, NULL, NULL);
+    shutdown_register("timers", 90, 1000, close_timers, NULL, NULL);
+    shutdown_register("logfile", 100, 1000, close_logfile, NULL, NULL);
 
     /*
-     * set handler for SIGHUP, SIGINT, and SIGTERM
+     * set handler for SIGHUP, SIGINT, and SIGTERM.  These stay blocked except
+     * while the main loop waits for the next tick.
      */
+    sigset_t handled_signals, wait_mask;
+    sigemptyset(&handled_signals);
+    sigaddset(&handled_signals, SIGHUP);
+    sigaddset(&handled_signals, SIGINT);
+    sigaddset(&handled_signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &handled_signals, &wait_mask);
+
     signal(SIGHUP, handle_signal);
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
@@ -530,13 +1149,33 @@ int main (int argc, char **argv)
      * do its daemon thing...
      */
     log_info("Now running");
+    PROBE(ready);
 
-    int i = 0;
     while (running == 1) {
-        log_info(((i++ % 2) == 0 ? "tick" : "tock"));
-        sleep(2);
+        char usage[256];
+        monitor_summary(usage, sizeof(usage));
+        log_info("%s, %s", (state.total_ticks % 2) == 0 ? "tick" : "tock",
+            usage);
+        ticks++;
+        state.total_ticks++;
+        PROBE1(loop_tick, ticks);
+
+        /*
+         * checkpoint after every tick.  This only writes to memory.
+         */
+        state_commit(&state);
+
+        /*
+         * the tick doubles as the flush timer for the local log file
+         */
+        logfile_flush();
+        wait_for_tick(&wait_mask);
     }
 
+    /*
+     * drain everything within the stop timeout before exiting
+     */
     log_info("Exiting");
+    shutdown_run(stop_timeout_ms);
     return EXIT_SUCCESS;
 }
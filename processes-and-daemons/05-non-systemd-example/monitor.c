@@ -0,0 +1,212 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "monitor.h"
+#include "timer.h"
+#include "util.h"
+
+/*
+ * The daemon watches its own scheduling and resource usage, so that it can
+ * tell when it is being starved instead of someone correlating timestamps by
+ * hand later.  Ten times a second it samples
+ *
+ *   /proc/self/schedstat  time spent running, and waiting on a run queue
+ *   /proc/self/status     voluntary and involuntary context switches, and RSS
+ *   getrusage()           minor and major page faults
+ *
+ * The files are opened once and re-read with pread() into static buffers, so
+ * a sample allocates nothing.  The cost of each sample is measured too, and
+ * is reported along with the rates.
+ */
+
+struct sample {
+    long     time_ns;
+    uint64_t run_ns;
+    uint64_t wait_ns;
+    uint64_t voluntary;
+    uint64_t involuntary;
+    uint64_t minor_faults;
+    uint64_t major_faults;
+    long     rss_kb;
+};
+
+struct rates {
+    double cpu_percent;
+    double wait_percent;
+    double voluntary;
+    double involuntary;
+    double minor_faults;
+    double major_faults;
+};
+
+static int schedstat_fd = -1;
+static int status_fd = -1;
+
+static struct sample previous;    // sample before the latest
+static struct sample latest;
+static struct sample reported;    // latest sample at the last summary
+
+static int      starved;
+static timer_id sample_timer;
+static long     sample_count;
+static long     sample_cost_ns;
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Value of a "Name:\t123" line in /proc/self/status
+ */
+static uint64_t status_field(const char *status, const char *name) {
+    const char *field = strstr(status, name);
+    return field ? strtoull(field + strlen(name), NULL, 10) : 0;
+}
+
+static void take_sample(struct sample *s) {
+    static char buffer[4096];
+    struct rusage usage;
+    ssize_t count;
+
+    s->time_ns = now_ns();
+
+    /* "run_ns wait_ns timeslices" */
+    if (schedstat_fd != -1
+        && (count = pread(schedstat_fd, buffer, sizeof(buffer) - 1, 0)) > 0) {
+        char *end;
+        buffer[count] = '\0';
+        s->run_ns = strtoull(buffer, &end, 10);
+        s->wait_ns = strtoull(end, NULL, 10);
+    }
+
+    if (status_fd != -1
+        && (count = pread(status_fd, buffer, sizeof(buffer) - 1, 0)) > 0) {
+        buffer[count] = '\0';
+        s->rss_kb = status_field(buffer, "\nVmRSS:");
+        s->voluntary = status_field(buffer, "\nvoluntary_ctxt_switches:");
+        s->involuntary = status_field(buffer, "\nnonvoluntary_ctxt_switches:");
+    }
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        s->minor_faults = usage.ru_minflt;
+        s->major_faults = usage.ru_majflt;
+    }
+}
+
+static void compute_rates(const struct sample *from, const struct sample *to,
+    struct rates *r) {
+    double seconds = (to->time_ns - from->time_ns) / 1e9;
+
+    memset(r, 0, sizeof(*r));
+    if (seconds <= 0)
+        return;
+
+    r->cpu_percent = (to->run_ns - from->run_ns) / 1e7 / seconds;
+    r->wait_percent = (to->wait_ns - from->wait_ns) / 1e7 / seconds;
+    r->voluntary = (to->voluntary - from->voluntary) / seconds;
+    r->involuntary = (to->involuntary - from->involuntary) / seconds;
+    r->minor_faults = (to->minor_faults - from->minor_faults) / seconds;
+    r->major_faults = (to->major_faults - from->major_faults) / seconds;
+}
+
+/*
+ * Take a sample, check for starvation, and schedule the next sample
+ */
+static void sample_expired(void *unused) {
+    struct rates r;
+    long start = now_ns();
+
+    previous = latest;
+    take_sample(&latest);
+    compute_rates(&previous, &latest, &r);
+
+    /*
+     * only report changes.  Leaving the starved state takes a drop to half
+     * the threshold, so that it does not flap.
+     */
+    if (!starved && r.wait_percent >= MONITOR_STARVED_PERCENT) {
+        starved = 1;
+        log_info("Starved, waited for a CPU %.1f%% of the last %d ms",
+            r.wait_percent, MONITOR_INTERVAL_MS);
+    } else if (starved && r.wait_percent < MONITOR_STARVED_PERCENT / 2.0) {
+        starved = 0;
+        log_info("No longer starved");
+    }
+
+    sample_cost_ns += now_ns() - start;
+    sample_count++;
+    sample_timer = timer_add(MONITOR_INTERVAL_MS, sample_expired, NULL);
+}
+
+/*
+ * Open the files to sample and start sampling.  This must be called after
+ * the last fork(), since the descriptors keep referring to the process that
+ * opened them.  Returns -1 if no file could be opened.
+ */
+int monitor_open() {
+    schedstat_fd = open("/proc/self/schedstat", O_RDONLY | O_CLOEXEC);
+    status_fd = open("/proc/self/status", O_RDONLY | O_CLOEXEC);
+
+    take_sample(&latest);
+    previous = reported = latest;
+    sample_timer = timer_add(MONITOR_INTERVAL_MS, sample_expired, NULL);
+
+    return schedstat_fd == -1 && status_fd == -1 ? -1 : 0;
+}
+
+/*
+ * Rates over the latest sampling period, one "name value" per line
+ */
+void monitor_report(char *buffer, size_t size) {
+    struct rates r;
+
+    compute_rates(&previous, &latest, &r);
+    snprintf(buffer, size,
+        "cpu_percent %.1f\n"
+        "run_queue_wait_percent %.1f\n"
+        "voluntary_switches_per_second %.1f\n"
+        "involuntary_switches_per_second %.1f\n"
+        "minor_faults_per_second %.1f\n"
+        "major_faults_per_second %.1f\n"
+        "rss_kb %ld\n"
+        "starved %d\n"
+        "monitor_sample_ns %ld\n",
+        r.cpu_percent, r.wait_percent, r.voluntary, r.involuntary,
+        r.minor_faults, r.major_faults, latest.rss_kb, starved,
+        sample_count ? sample_cost_ns / sample_count : 0);
+}
+
+/*
+ * Rates since the previous summary, on one line for the tick log
+ */
+void monitor_summary(char *buffer, size_t size) {
+    struct rates r;
+
+    compute_rates(&reported, &latest, &r);
+    reported = latest;
+    snprintf(buffer, size,
+        "cpu %.1f%% wait %.1f%% csw %.0f/s icsw %.0f/s flt %.0f/s "
+        "majflt %.0f/s rss %ld kB",
+        r.cpu_percent, r.wait_percent, r.voluntary, r.involuntary,
+        r.minor_faults, r.major_faults, latest.rss_kb);
+}
+
+void monitor_close() {
+    timer_cancel(sample_timer);
+    sample_timer = 0;
+
+    if (schedstat_fd != -1)
+        close(schedstat_fd);
+    if (status_fd != -1)
+        close(status_fd);
+    schedstat_fd = status_fd = -1;
+}
@@ -0,0 +1,22 @@
+#ifndef __MONITOR_H__
+#define __MONITOR_H__
+
+#include <stddef.h>
+
+/*
+ * Sampling period, i.e. 10 Hz
+ */
+#define MONITOR_INTERVAL_MS 100
+
+/*
+ * Share of a sampling period spent waiting for a CPU, in percent, above which
+ * the daemon is considered starved
+ */
+#define MONITOR_STARVED_PERCENT 10
+
+int  monitor_open();
+void monitor_report(char *buffer, size_t size);
+void monitor_summary(char *buffer, size_t size);
+void monitor_close();
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/*
+ * USDT (user statically defined tracing) probes.  Each one costs a single nop
+ * until a tracer such as perf or bpftrace attaches to it.  List them with
+ *
+ *     readelf -n simple-daemon
+ *
+ * Use the system <sys/sdt.h> when it is installed and fall back to the
+ * minimal copy in this directory otherwise.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#else
+#include "sdt.h"
+#endif
+#else
+#include "sdt.h"
+#endif
+
+#define PROBE(name)             DTRACE_PROBE(simple_daemon, name)
+#define PROBE1(name, a1)        DTRACE_PROBE1(simple_daemon, name, a1)
+#define PROBE2(name, a1, a2)    DTRACE_PROBE2(simple_daemon, name, a1, a2)
+
+#endif
@@ -0,0 +1,275 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "psi.h"
+#include "timer.h"
+#include "util.h"
+
+/*
+ * Pressure stall information (PSI) reports how long tasks were stalled
+ * waiting for CPU, memory, or I/O.  See
+ * https://docs.kernel.org/accounting/psi.html
+ *
+ * Writing a trigger to a pressure file, here "tasks stalled for 200 ms of any
+ * 2 second window", makes the kernel wake up pollers with POLLPRI when the
+ * threshold is crossed.  Windows of 2 seconds are the shortest unprivileged
+ * users may ask for.  The daemon's own cgroup is watched when it has pressure
+ * files, otherwise the system wide files in /proc/pressure.
+ *
+ * Where no trigger can be registered, e.g. for a plain file used in testing,
+ * the file is read every second instead and "some avg10" is compared to a
+ * threshold.
+ *
+ * The kernel may report a trigger that the stall time does not bear out, e.g.
+ * right after it is registered.  So the "some total" of a file, the stall
+ * time in microseconds, is sampled every second, and an event only counts if
+ * total grew by the threshold of the trigger since a sample at least one
+ * window old.
+ *
+ * A stall keeps triggering for as long as it lasts, and on several resources
+ * at once, so the daemon backs off at most one level per trigger window.
+ * Recovery is checked on its own timer rather than on the tick, which gets
+ * slower the more the daemon backs off.
+ */
+#define PSI_TRIGGER         "some 200000 2000000"
+#define PSI_STALL_US        200000
+#define PSI_WINDOW_MS       2000
+#define PSI_AVG10_THRESHOLD 10.0
+#define PSI_CHECK_MS        1000
+
+/*
+ * Samples of "some total" kept, newest first.  The oldest is at least one
+ * window old.
+ */
+#define PSI_SAMPLES (PSI_WINDOW_MS / PSI_CHECK_MS + 1)
+
+struct source {
+    int      fd;
+    int      polled;         // no trigger, read avg10 on every check
+    uint64_t totals[PSI_SAMPLES];
+    char     path[PATH_MAX];
+};
+
+static const char *resources[] = { "cpu", "memory", "io" };
+
+static struct source sources[3];
+static int source_count = 0;
+static int level = 0;
+static long last_event_ms;
+static long last_raise_ms;
+static timer_id check_timer;
+static psi_handler on_change;
+
+static void set_level(int new_level) {
+    if (new_level == level)
+        return;
+
+    level = new_level;
+    if (on_change)
+        on_change(level);
+}
+
+/*
+ * Back off one more level on pressure, unless that already happened within
+ * the current trigger window
+ */
+static void pressure_event(struct source *src) {
+    last_event_ms = monotonic_ms();
+    if (level < PSI_MAX_LEVEL
+        && last_event_ms - last_raise_ms >= PSI_WINDOW_MS) {
+        last_raise_ms = last_event_ms;
+        log_info("Pressure reported by %s", src->path);
+        set_level(level + 1);
+    }
+}
+
+static void close_source(struct source *src) {
+    if (!src->polled)
+        event_del(src->fd);
+    close(src->fd);
+    src->fd = -1;
+}
+
+/*
+ * Parse the "total=" of the "some" line of a pressure file
+ */
+static uint64_t read_total(int fd) {
+    char buffer[256];
+
+    ssize_t count = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (count <= 0)
+        return 0;
+    buffer[count] = '\0';
+
+    char *total = strstr(buffer, "total=");
+    return total ? strtoull(total + strlen("total="), NULL, 10) : 0;
+}
+
+static void handle_trigger(int fd, unsigned int events, void *arg) {
+    struct source *src = arg;
+
+    /* the cgroup went away */
+    if (events & EPOLLERR) {
+        close_source(src);
+        return;
+    }
+
+    if ((events & EPOLLPRI)
+        && read_total(src->fd) - src->totals[PSI_SAMPLES - 1] >= PSI_STALL_US)
+        pressure_event(src);
+}
+
+/*
+ * Parse "some avg10=1.23 avg60=..." from the start of a pressure file
+ */
+static double read_avg10(int fd) {
+    char buffer[256];
+
+    ssize_t count = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (count <= 0)
+        return 0;
+    buffer[count] = '\0';
+
+    char *avg10 = strstr(buffer, "some avg10=");
+    return avg10 ? strtod(avg10 + strlen("some avg10="), NULL) : 0;
+}
+
+static void take_sample(struct source *src) {
+    memmove(src->totals + 1, src->totals,
+        (PSI_SAMPLES - 1) * sizeof(src->totals[0]));
+    src->totals[0] = read_total(src->fd);
+}
+
+static void open_source(const char *path, int polled) {
+    struct source *src = &sources[source_count];
+
+    strcpy(src->path, path);
+    src->polled = polled;
+    src->fd = open(path, (polled ? O_RDONLY : O_RDWR | O_NONBLOCK) | O_CLOEXEC);
+
+    if (src->fd == -1 && !polled) {
+        src->polled = 1;
+        src->fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (src->fd == -1)
+        return;
+
+    if (!src->polled
+        && (write(src->fd, PSI_TRIGGER, strlen(PSI_TRIGGER) + 1) == -1
+            || event_add(src->fd, EPOLLPRI, handle_trigger, src) == -1)) {
+        /* reopen, a file with a failed trigger write may be unusable */
+        close(src->fd);
+        src->polled = 1;
+        src->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (src->fd == -1)
+            return;
+    }
+
+    for (int i = 0; i < PSI_SAMPLES; i++)
+        take_sample(src);
+    source_count++;
+}
+
+/*
+ * Directory of this process' cgroup v2 in the unified hierarchy, or an empty
+ * string
+ */
+static void find_cgroup_dir(char *dir, size_t size) {
+    char line[PATH_MAX];
+    FILE *cgroup = fopen("/proc/self/cgroup", "r");
+
+    dir[0] = '\0';
+    if (cgroup == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), cgroup)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            int len = snprintf(dir, size, "/sys/fs/cgroup%s", line + 3);
+            if (len < 0 || (size_t)len >= size)
+                dir[0] = '\0';
+            break;
+        }
+    }
+    fclose(cgroup);
+}
+
+/*
+ * Sample the files with a trigger and read those without one, then step down
+ * one level if there was no pressure for PSI_RECOVERY_MS.  Requiring a quiet
+ * period for every step keeps the daemon from flapping between levels.
+ */
+static void check_expired(void *unused) {
+    for (int i = 0; i < source_count; i++) {
+        if (sources[i].fd == -1)
+            continue;
+
+        if (!sources[i].polled)
+            take_sample(&sources[i]);
+        else if (read_avg10(sources[i].fd) >= PSI_AVG10_THRESHOLD)
+            pressure_event(&sources[i]);
+    }
+
+    long now = monotonic_ms();
+    if (level > 0 && now - last_event_ms >= PSI_RECOVERY_MS) {
+        last_event_ms = now;
+        log_info("Pressure cleared");
+        set_level(level - 1);
+    }
+
+    check_timer = timer_add(PSI_CHECK_MS, check_expired, NULL);
+}
+
+/*
+ * Watch pressure_file if given, otherwise the CPU, memory, and I/O pressure
+ * of this cgroup or of the whole system.  The timing wheel must be open.
+ * Returns the number of pressure files watched.
+ */
+int psi_open(const char *pressure_file, psi_handler handler) {
+    on_change = handler;
+    last_event_ms = monotonic_ms();
+    last_raise_ms = last_event_ms - PSI_WINDOW_MS;
+    check_timer = timer_add(PSI_CHECK_MS, check_expired, NULL);
+
+    if (pressure_file) {
+        open_source(pressure_file, 1);
+        return source_count;
+    }
+
+    char cgroup_dir[PATH_MAX], path[PATH_MAX];
+    find_cgroup_dir(cgroup_dir, sizeof(cgroup_dir));
+
+    for (int i = 0; i < 3; i++) {
+        int len = snprintf(path, sizeof(path), "%s/%s.pressure", cgroup_dir,
+            resources[i]);
+        if (cgroup_dir[0] == '\0' || len >= (int)sizeof(path)
+            || access(path, R_OK) == -1)
+            snprintf(path, sizeof(path), "/proc/pressure/%s", resources[i]);
+
+        if (access(path, R_OK) == 0)
+            open_source(path, 0);
+    }
+
+    return source_count;
+}
+
+int psi_level() {
+    return level;
+}
+
+void psi_close() {
+    timer_cancel(check_timer);
+    check_timer = 0;
+
+    for (int i = 0; i < source_count; i++)
+        if (sources[i].fd != -1)
+            close_source(&sources[i]);
+    source_count = 0;
+}
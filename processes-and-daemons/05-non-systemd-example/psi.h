@@ -0,0 +1,23 @@
+#ifndef __PSI_H__
+#define __PSI_H__
+
+/*
+ * Highest load shedding level.  Each level doubles the tick period.
+ */
+#define PSI_MAX_LEVEL 3
+
+/*
+ * Quiet time needed before stepping down one level
+ */
+#define PSI_RECOVERY_MS 10000
+
+/*
+ * Called whenever the load shedding level changes
+ */
+typedef void (*psi_handler)(int level);
+
+int  psi_open(const char *pressure_file, psi_handler handler);
+int  psi_level();
+void psi_close();
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef __SDT_H__
+#define __SDT_H__
+
+/*
+ * Minimal stand-in for <sys/sdt.h> from systemtap-sdt-devel, used only when
+ * that header is not installed.  It emits the same ".note.stapsdt" ELF notes,
+ * so perf, bpftrace, and systemtap find the probes the same way.
+ *
+ * Each probe compiles to a single nop.  The note records the address of the
+ * nop and where each argument lives at that point (register, memory, or
+ * constant), so the arguments are only read when a tracer is attached.
+ *
+ * To keep this small, every argument is passed as a signed long.  Pass
+ * pointers, such as strings, by casting them.
+ */
+
+#if defined(__LP64__)
+#define _SDT_ASM_ADDR ".8byte"
+#define _SDT_ARGSIZE  "-8"
+#else
+#define _SDT_ASM_ADDR ".4byte"
+#define _SDT_ARGSIZE  "-4"
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define _SDT_ARG_CONSTRAINT "nor"
+#else
+#define _SDT_ARG_CONSTRAINT "r"
+#endif
+
+#define _SDT_ARG(n, x) [_SDT_A##n] _SDT_ARG_CONSTRAINT ((long)(x))
+#define _SDT_FMT(n)    _SDT_ARGSIZE "@%[_SDT_A" #n "]"
+
+#define _SDT_FMT_0 ""
+#define _SDT_FMT_1 _SDT_FMT(1)
+#define _SDT_FMT_2 _SDT_FMT_1 " " _SDT_FMT(2)
+#define _SDT_FMT_3 _SDT_FMT_2 " " _SDT_FMT(3)
+#define _SDT_FMT_4 _SDT_FMT_3 " " _SDT_FMT(4)
+
+/*
+ * The note layout is: probe address, address of the .stapsdt.base section
+ * (used to correct for prelinking), semaphore address (unused here), then the
+ * provider, probe name, and argument description as strings.
+ */
+#define _SDT_ASM_BODY(provider, name, fmt)                                    \
+    "990: nop\n"                                                              \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                             \
+    ".balign 4\n"                                                             \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                        \
+    "991: .asciz \"stapsdt\"\n"                                               \
+    "992: .balign 4\n"                                                        \
+    "993: " _SDT_ASM_ADDR " 990b\n"                                           \
+    _SDT_ASM_ADDR " _.stapsdt.base\n"                                         \
+    _SDT_ASM_ADDR " 0\n"                                                      \
+    ".asciz \"" #provider "\"\n"                                              \
+    ".asciz \"" #name "\"\n"                                                  \
+    ".asciz \"" fmt "\"\n"                                                    \
+    "994: .balign 4\n"                                                        \
+    ".popsection\n"                                                           \
+    ".ifndef _.stapsdt.base\n"                                                \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"   \
+    ".weak _.stapsdt.base\n"                                                  \
+    ".hidden _.stapsdt.base\n"                                                \
+    "_.stapsdt.base: .space 1\n"                                              \
+    ".size _.stapsdt.base, 1\n"                                               \
+    ".popsection\n"                                                           \
+    ".endif\n"
+
+#define DTRACE_PROBE(provider, name)                                          \
+    __asm__ __volatile__ (_SDT_ASM_BODY(provider, name, _SDT_FMT_0) :: )
+
+#define DTRACE_PROBE1(provider, name, a1)                                     \
+    __asm__ __volatile__ (_SDT_ASM_BODY(provider, name, _SDT_FMT_1)           \
+        :: _SDT_ARG(1, a1))
+
+#define DTRACE_PROBE2(provider, name, a1, a2)                                 \
+    __asm__ __volatile__ (_SDT_ASM_BODY(provider, name, _SDT_FMT_2)           \
+        :: _SDT_ARG(1, a1), _SDT_ARG(2, a2))
+
+#define DTRACE_PROBE3(provider, name, a1, a2, a3)                             \
+    __asm__ __volatile__ (_SDT_ASM_BODY(provider, name, _SDT_FMT_3)           \
+        :: _SDT_ARG(1, a1), _SDT_ARG(2, a2), _SDT_ARG(3, a3))
+
+#define DTRACE_PROBE4(provider, name, a1, a2, a3, a4)                         \
+    __asm__ __volatile__ (_SDT_ASM_BODY(provider, name, _SDT_FMT_4)           \
+        :: _SDT_ARG(1, a1), _SDT_ARG(2, a2), _SDT_ARG(3, a3), _SDT_ARG(4, a4))
+
+#endif
@@ -0,0 +1,98 @@
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "shutdown.h"
+#include "util.h"
+
+/*
+ * How long to wait between calls to a drain hook that still has work in flight
+ */
+#define DRAIN_POLL_NS 1000000
+
+struct hook {
+    const char *name;
+    int        priority;
+    long       deadline_ms;
+    drain_hook drain;
+    force_hook force;
+    void       *arg;
+};
+
+/*
+ * Registered hooks, kept sorted by priority.  Lower priorities run first.
+ */
+static struct hook hooks[SHUTDOWN_MAX_HOOKS];
+static int hook_count = 0;
+
+int shutdown_register(const char *name, int priority, long deadline_ms,
+    drain_hook drain, force_hook force, void *arg) {
+    if (hook_count == SHUTDOWN_MAX_HOOKS)
+        return -1;
+
+    /* insert after any hooks of the same priority so registration order holds */
+    int i = hook_count++;
+    while (i > 0 && hooks[i - 1].priority > priority) {
+        hooks[i] = hooks[i - 1];
+        i--;
+    }
+
+    hooks[i].name = name;
+    hooks[i].priority = priority;
+    hooks[i].deadline_ms = deadline_ms;
+    hooks[i].drain = drain;
+    hooks[i].force = force;
+    hooks[i].arg = arg;
+    return 0;
+}
+
+/*
+ * Run every drain hook in priority order.  Each hook gets the smaller of its
+ * own deadline and whatever remains of the overall budget, less
+ * SHUTDOWN_RESERVE_MS.  Hooks that miss their deadline are force stopped so
+ * the next phase can start on time.  Once the budget is used up, every
+ * remaining hook is still called once, and forced if it is not drained.
+ *
+ * As a last resort, a timer for the budget plus SHUTDOWN_BACKSTOP_MARGIN_MS
+ * is armed with the default action for SIGALRM, which terminates the process.
+ * This covers a hook that blocks in a system call and never returns.
+ */
+void shutdown_run(long budget_ms) {
+    long start = monotonic_ms();
+    long drain_end = start + budget_ms - SHUTDOWN_RESERVE_MS;
+    long backstop_ms = budget_ms + SHUTDOWN_BACKSTOP_MARGIN_MS;
+
+    struct itimerval backstop;
+    memset(&backstop, 0, sizeof(backstop));
+    backstop.it_value.tv_sec = backstop_ms / 1000;
+    backstop.it_value.tv_usec = (backstop_ms % 1000) * 1000;
+    signal(SIGALRM, SIG_DFL);
+    setitimer(ITIMER_REAL, &backstop, NULL);
+
+    for (int i = 0; i < hook_count; i++) {
+        struct hook *hook = &hooks[i];
+        long phase_start = monotonic_ms();
+        long phase_end = phase_start + hook->deadline_ms;
+        if (phase_end > drain_end)
+            phase_end = drain_end;
+
+        int drained;
+        while (!(drained = hook->drain(hook->arg))
+               && monotonic_ms() < phase_end) {
+            struct timespec pause = { 0, DRAIN_POLL_NS };
+            nanosleep(&pause, NULL);
+        }
+
+        if (!drained && hook->force)
+            hook->force(hook->arg);
+
+        log_info("Shutdown phase %s %s in %ld ms", hook->name,
+            drained ? "drained" : "forced", monotonic_ms() - phase_start);
+    }
+
+    memset(&backstop, 0, sizeof(backstop));
+    setitimer(ITIMER_REAL, &backstop, NULL);
+
+    log_info("Shutdown completed in %ld ms", monotonic_ms() - start);
+}
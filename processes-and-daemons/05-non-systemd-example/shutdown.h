@@ -0,0 +1,39 @@
+#ifndef __SHUTDOWN_H__
+#define __SHUTDOWN_H__
+
+/*
+ * Most drain hooks that can be registered
+ */
+#define SHUTDOWN_MAX_HOOKS 16
+
+/*
+ * Default overall shutdown budget.  This stays below the default
+ * TimeoutStopSec of 90 seconds in systemd, after which systemd sends SIGKILL,
+ * so that the daemon's own backstop fires first.
+ */
+#define SHUTDOWN_DEFAULT_BUDGET_MS 80000
+
+/*
+ * End of the budget kept back from draining, so that stragglers can be forced
+ * and the last phases, like removing the pid file, still run
+ */
+#define SHUTDOWN_RESERVE_MS 2000
+
+/*
+ * Time past the budget before the backstop terminates the process
+ */
+#define SHUTDOWN_BACKSTOP_MARGIN_MS 2000
+
+/*
+ * A drain hook returns 1 once its subsystem is drained and 0 if work is still
+ * in flight, in which case it is called again until its deadline passes.  The
+ * optional force hook is then called to stop whatever is left.
+ */
+typedef int  (*drain_hook)(void *arg);
+typedef void (*force_hook)(void *arg);
+
+int  shutdown_register(const char *name, int priority, long deadline_ms,
+         drain_hook drain, force_hook force, void *arg);
+void shutdown_run(long budget_ms);
+
+#endif
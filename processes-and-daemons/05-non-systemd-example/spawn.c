@@ -0,0 +1,430 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "probes.h"
+#include "spawn.h"
+
+/*
+ * Every fork() copies the page tables of the calling process and makes all of
+ * its memory copy-on-write.  For a daemon with a large heap that gets slow,
+ * and the copy-on-write faults slow down the daemon itself afterwards.
+ *
+ * Instead, a small spawn server (a "zygote") is forked early in start up
+ * while the daemon is still small.  Later, the daemon sends it the arguments,
+ * environment, and standard file descriptors of a program to run over a UNIX
+ * domain socket, and the zygote does the fork() and exec() on its behalf.
+ * File descriptors are passed with SCM_RIGHTS as described in "man 7 unix".
+ * The zygote answers with the new pid and, if the kernel supports it, a pidfd
+ * that becomes readable when the process exits.
+ */
+
+struct spawn_request {
+    uint32_t argc;
+    uint32_t envc;
+    char     strings[];      // argc + envc NUL terminated strings
+};
+
+struct spawn_reply {
+    int32_t pid;
+    int32_t error;           // errno if the program could not be started
+};
+
+static int server_fd = -1;   // daemon end of the socket pair
+static pid_t server_pid = -1;
+
+/*
+ * Send a message with up to three file descriptors attached
+ */
+static int send_with_fds(int fd, const void *buf, size_t len, const int *fds,
+    int fd_count) {
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { (void *)buf, len };
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd_count > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+    }
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ * Receive a message and any attached file descriptors.  Returns the message
+ * length, 0 if the other end closed, or -1.
+ */
+static ssize_t recv_with_fds(int fd, void *buf, size_t len, int *fds,
+    int *fd_count, int max_fds) {
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t count;
+    do
+        count = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    while (count == -1 && errno == EINTR);
+
+    *fd_count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *passed = (int *)CMSG_DATA(cmsg);
+        for (int i = 0; i < received; i++)
+            if (*fd_count < max_fds)
+                fds[(*fd_count)++] = passed[i];
+            else
+                close(passed[i]);
+    }
+
+    if (count >= 0 && (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        for (int i = 0; i < *fd_count; i++)
+            close(fds[i]);
+        *fd_count = 0;
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    return count;
+}
+
+/*
+ * The zygote must not hold on to anything the daemon opened, like the lock
+ * file, so close every descriptor except standard input, output, error and
+ * the socket to the daemon.
+ */
+static void close_other_fds(int keep_fd) {
+    DIR *fd_list = opendir("/proc/self/fd");
+    if (!fd_list)
+        return;
+
+    int dir_fd = dirfd(fd_list);
+    struct dirent *current_entry;
+    while ((current_entry = readdir(fd_list)) != NULL) {
+        char *end_filename;
+        int current_fd = strtol(current_entry->d_name, &end_filename, 10);
+
+        if (*current_entry->d_name != '\0' && *end_filename == '\0'
+            && current_fd != dir_fd && current_fd != keep_fd && current_fd > 2)
+            close(current_fd);
+    }
+    closedir(fd_list);
+}
+
+/*
+ * Runs in the new process.  Install the passed descriptors as standard input,
+ * output, and error and run the program.  If exec fails, errno is written to
+ * the status pipe.  On success the pipe is closed by O_CLOEXEC instead, which
+ * is how the zygote tells the two apart.
+ */
+static void exec_child(char **argv, char **envp, int *fds, int status_fd) {
+    for (int i = 0; i < 3; i++)
+        if (dup2(fds[i], i) == -1)
+            goto failed;
+
+    sigset_t signal_set;
+    sigemptyset(&signal_set);
+    sigprocmask(SIG_SETMASK, &signal_set, NULL);
+    signal(SIGCHLD, SIG_DFL);
+
+    execvpe(argv[0], argv, envp);
+
+failed:
+    write(status_fd, &errno, sizeof(errno));
+    _exit(127);
+}
+
+/*
+ * Start one program for the daemon and send back its pid and pidfd
+ */
+static void handle_request(int sock, struct spawn_request *req, size_t len,
+    int *fds) {
+    struct spawn_reply reply = { -1, 0 };
+    char *argv[SPAWN_MAX_ARGS + 1], *envp[SPAWN_MAX_ARGS + 1];
+    char *cur = req->strings, *end = (char *)req + len;
+    int pidfd = -1;
+
+    if (req->argc < 1 || req->argc > SPAWN_MAX_ARGS
+        || req->envc > SPAWN_MAX_ARGS) {
+        reply.error = EINVAL;
+        goto done;
+    }
+
+    /* make sure every string is terminated inside the message */
+    for (uint32_t i = 0; i < req->argc + req->envc; i++) {
+        char *nul = cur < end ? memchr(cur, '\0', end - cur) : NULL;
+        if (nul == NULL) {
+            reply.error = EINVAL;
+            goto done;
+        }
+        if (i < req->argc)
+            argv[i] = cur;
+        else
+            envp[i - req->argc] = cur;
+        cur = nul + 1;
+    }
+    argv[req->argc] = 0;
+    envp[req->envc] = 0;
+
+    int status_pipe[2];
+    if (pipe2(status_pipe, O_CLOEXEC) == -1) {
+        reply.error = errno;
+        goto done;
+    }
+
+    pid_t pid = fork();
+    PROBE1(fork_return, pid);
+    if (pid == 0) {
+        close(sock);
+        close(status_pipe[0]);
+        exec_child(argv, envp, fds, status_pipe[1]);
+    }
+    if (pid == -1)
+        reply.error = errno;
+    close(status_pipe[1]);
+
+    if (pid != -1) {
+        int exec_errno;
+        ssize_t count;
+
+        do
+            count = read(status_pipe[0], &exec_errno, sizeof(exec_errno));
+        while (count == -1 && errno == EINTR);
+
+        if (count == sizeof(exec_errno)) {
+            reply.error = exec_errno;
+        } else {
+            reply.pid = pid;
+#ifdef SYS_pidfd_open
+            pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+        }
+    }
+    close(status_pipe[0]);
+
+done:
+    send_with_fds(sock, &reply, sizeof(reply), &pidfd, pidfd == -1 ? 0 : 1);
+    if (pidfd != -1)
+        close(pidfd);
+}
+
+static void child_exited(int signum) {
+}
+
+/*
+ * Main loop of the zygote.  It exits once the daemon closes its end of the
+ * socket, or dies.
+ */
+static void serve(int sock) {
+    char buffer[SPAWN_MSG_MAX];
+    struct spawn_request *req = (struct spawn_request *)buffer;
+    struct pollfd request = { sock, POLLIN, 0 };
+    struct sigaction action;
+    sigset_t blocked, waiting;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1)
+        _exit(EXIT_SUCCESS);
+
+    /*
+     * The spawned programs must not be reaped before pidfd_open() has been
+     * called for them, or their pid may already belong to another process.
+     * So SIGCHLD is not ignored, which would have the kernel reap them at
+     * once.  It is blocked instead, and only delivered while waiting for the
+     * next request, after which every exited program is reaped.  A pidfd
+     * stays readable after its process was reaped.
+     */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = child_exited;
+    sigaction(SIGCHLD, &action, NULL);
+
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &blocked, &waiting);
+    sigdelset(&waiting, SIGCHLD);
+
+    close_other_fds(sock);
+
+    while (1) {
+        int fds[3], fd_count;
+
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            ;
+        if (ppoll(&request, 1, NULL, &waiting) == -1)
+            continue;
+
+        ssize_t len = recv_with_fds(sock, buffer, sizeof(buffer), fds,
+            &fd_count, 3);
+
+        if (len == 0)
+            _exit(EXIT_SUCCESS);
+
+        if (len < (ssize_t)sizeof(*req) || fd_count != 3) {
+            struct spawn_reply reply = { -1, EINVAL };
+            send_with_fds(sock, &reply, sizeof(reply), NULL, 0);
+        } else
+            handle_request(sock, req, len, fds);
+
+        for (int i = 0; i < fd_count; i++)
+            close(fds[i]);
+    }
+}
+
+/*
+ * Fork the zygote.  Call this early, before the daemon grows.
+ */
+int spawn_server_start() {
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+        return -1;
+
+    server_pid = fork();
+    PROBE1(fork_return, server_pid);
+    if (server_pid == -1) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    if (server_pid == 0) {
+        close(sv[0]);
+        serve(sv[1]);
+    }
+
+    close(sv[1]);
+    server_fd = sv[0];
+    return 0;
+}
+
+int spawn_server_running() {
+    return server_fd != -1;
+}
+
+/*
+ * Ask the zygote to run argv with environment envp and fds as standard input,
+ * output, and error.  Returns the pid or -1 with errno set.  If pidfd is not
+ * NULL it receives a pidfd for the new process, or -1 on kernels without
+ * pidfd_open().  The spawned process is a child of the zygote, so it cannot
+ * be waited for, but the pidfd can be polled.
+ */
+pid_t spawn_process(char *const argv[], char *const envp[], const int fds[3],
+    int *pidfd) {
+    char buffer[SPAWN_MSG_MAX];
+    struct spawn_request *req = (struct spawn_request *)buffer;
+    size_t len = sizeof(*req);
+
+    if (pidfd)
+        *pidfd = -1;
+    if (server_fd == -1) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    req->argc = req->envc = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        char *const *strings = pass == 0 ? argv : envp;
+
+        for (int i = 0; strings && strings[i]; i++) {
+            size_t string_len = strlen(strings[i]) + 1;
+
+            if (len + string_len > sizeof(buffer)) {
+                errno = E2BIG;
+                return -1;
+            }
+            memcpy(buffer + len, strings[i], string_len);
+            len += string_len;
+            if (pass == 0)
+                req->argc++;
+            else
+                req->envc++;
+        }
+    }
+
+    if (send_with_fds(server_fd, buffer, len, fds, 3) == -1)
+        return -1;
+
+    struct spawn_reply reply;
+    int received[1], fd_count;
+    ssize_t count = recv_with_fds(server_fd, &reply, sizeof(reply), received,
+        &fd_count, 1);
+    if (count != sizeof(reply)) {
+        if (count >= 0)
+            errno = EPIPE;
+        return -1;
+    }
+
+    if (fd_count == 1) {
+        if (pidfd)
+            *pidfd = received[0];
+        else
+            close(received[0]);
+    }
+
+    if (reply.pid == -1) {
+        errno = reply.error;
+        return -1;
+    }
+    return reply.pid;
+}
+
+/*
+ * Close the socket so the zygote exits.  Returns 1 once it has been reaped.
+ */
+int spawn_server_stop() {
+    if (server_fd != -1) {
+        close(server_fd);
+        server_fd = -1;
+    }
+
+    if (server_pid == -1)
+        return 1;
+
+    pid_t rc = waitpid(server_pid, NULL, WNOHANG);
+    if (rc == 0)
+        return 0;
+
+    server_pid = -1;
+    return 1;
+}
+
+void spawn_server_kill() {
+    if (server_pid == -1)
+        return;
+
+    kill(server_pid, SIGKILL);
+    waitpid(server_pid, NULL, 0);
+    server_pid = -1;
+}
@@ -0,0 +1,19 @@
+#ifndef __SPAWN_H__
+#define __SPAWN_H__
+
+#include <sys/types.h>
+
+/*
+ * Largest spawn request, i.e. all argument and environment strings together
+ */
+#define SPAWN_MSG_MAX  8192
+#define SPAWN_MAX_ARGS 64
+
+int   spawn_server_start();
+int   spawn_server_running();
+pid_t spawn_process(char *const argv[], char *const envp[], const int fds[3],
+          int *pidfd);
+int   spawn_server_stop();
+void  spawn_server_kill();
+
+#endif
@@ -0,0 +1,184 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "state.h"
+
+/*
+ * State is checkpointed to a small file that is mapped into memory, so a
+ * restarted daemon can pick up where its predecessor left off instead of
+ * starting cold.
+ *
+ * The file holds two slots.  A commit always overwrites the older slot and
+ * gives it the next sequence number, so the newer slot stays intact until the
+ * commit is complete.  Each slot carries a checksum over its sequence number
+ * and data.  At start up the valid slot with the highest sequence number is
+ * adopted, which tolerates a predecessor that crashed in the middle of a
+ * commit.  Commits only write to memory and ask for an asynchronous write
+ * back, so they never wait for the disk.
+ */
+
+#define STATE_MAGIC 0x5441545344444d53ULL     // "SMDDSTAT"
+
+struct slot_header {
+    uint64_t sequence;       // 0 if the slot was never written
+    uint64_t checksum;
+};
+
+struct file_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t data_size;
+};
+
+static int state_fd = -1;
+static char *mapping;
+static size_t mapping_size;
+static size_t data_size;
+static uint64_t sequence;   // sequence number of the newest slot
+static int newest_slot;
+
+static size_t slot_offset(int slot) {
+    size_t slot_size = (sizeof(struct slot_header) + data_size + 7) & ~7UL;
+    return sizeof(struct file_header) + slot * slot_size;
+}
+
+static struct slot_header *slot_at(int slot) {
+    return (struct slot_header *)(mapping + slot_offset(slot));
+}
+
+/*
+ * 64-bit FNV-1a hash.  This is not cryptographic, it only has to catch torn
+ * or stale writes.
+ */
+static uint64_t checksum(uint64_t seq, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (int i = 0; i < 8; i++) {
+        hash ^= (seq >> (i * 8)) & 0xff;
+        hash *= 0x100000001b3ULL;
+    }
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int slot_is_valid(int slot) {
+    struct slot_header *hdr = slot_at(slot);
+
+    return hdr->sequence != 0
+        && hdr->checksum == checksum(hdr->sequence, hdr + 1, data_size);
+}
+
+/*
+ * Map the state file at path, creating it if necessary.  If it holds valid
+ * state of the same version and size, copy it into data and return 1.  The
+ * caller bumps version whenever the layout of data changes.  If there is
+ * nothing to adopt, leave data alone and return 0.  Returns -1 if the file
+ * cannot be used.
+ */
+int state_open(const char *path, uint32_t version, void *data, size_t size) {
+    data_size = size;
+    mapping_size = slot_offset(2);
+
+    state_fd = open(path, O_CREAT | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (state_fd == -1)
+        return -1;
+
+    struct stat st;
+    if (fstat(state_fd, &st) == -1
+        || (st.st_size != (off_t)mapping_size
+            && ftruncate(state_fd, mapping_size) == -1)) {
+        close(state_fd);
+        state_fd = -1;
+        return -1;
+    }
+
+    mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        state_fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(state_fd);
+        state_fd = -1;
+        return -1;
+    }
+
+    /*
+     * a file of the wrong size, version, or layout is not ours to adopt, so
+     * start over with empty slots
+     */
+    struct file_header *hdr = (struct file_header *)mapping;
+    if (st.st_size != (off_t)mapping_size || hdr->magic != STATE_MAGIC
+        || hdr->version != version || hdr->data_size != size) {
+        memset(mapping, 0, mapping_size);
+        hdr->magic = STATE_MAGIC;
+        hdr->version = version;
+        hdr->data_size = size;
+        sequence = 0;
+        newest_slot = 1;
+        return 0;
+    }
+
+    int newest = -1;
+    for (int slot = 0; slot < 2; slot++)
+        if (slot_is_valid(slot)
+            && (newest == -1
+                || slot_at(slot)->sequence > slot_at(newest)->sequence))
+            newest = slot;
+
+    if (newest == -1) {
+        sequence = 0;
+        newest_slot = 1;
+        return 0;
+    }
+
+    newest_slot = newest;
+    sequence = slot_at(newest)->sequence;
+    memcpy(data, slot_at(newest) + 1, size);
+    return 1;
+}
+
+/*
+ * Write data to the older slot.  The sequence number is stored last, after a
+ * release barrier, so the slot only becomes the newest once it is complete.
+ */
+void state_commit(const void *data) {
+    if (state_fd == -1)
+        return;
+
+    uint64_t next = sequence + 1;
+    struct slot_header *hdr = slot_at(!newest_slot);
+
+    hdr->sequence = 0;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(hdr + 1, data, data_size);
+    hdr->checksum = checksum(next, data, data_size);
+    __atomic_store_n(&hdr->sequence, next, __ATOMIC_RELEASE);
+
+    sequence = next;
+    newest_slot = !newest_slot;
+    msync(mapping, mapping_size, MS_ASYNC);
+}
+
+/*
+ * Wait for the last commit to reach the disk, e.g. on shutdown
+ */
+void state_sync() {
+    if (state_fd != -1)
+        msync(mapping, mapping_size, MS_SYNC);
+}
+
+void state_close() {
+    if (state_fd == -1)
+        return;
+
+    munmap(mapping, mapping_size);
+    close(state_fd);
+    state_fd = -1;
+}
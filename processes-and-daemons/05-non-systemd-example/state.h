@@ -0,0 +1,12 @@
+#ifndef __STATE_H__
+#define __STATE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+int  state_open(const char *path, uint32_t version, void *data, size_t size);
+void state_commit(const void *data);
+void state_sync();
+void state_close();
+
+#endif
@@ -0,0 +1,385 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Lifecycle stress and benchmark harness for simple-daemon.  This repeatedly
+ * starts and stops the daemon, several at a time, and measures
+ *
+ *   start_to_ready   spawning "simple-daemon -d" until the original parent
+ *                    exits, which by Item 15 of "man 7 daemon" only happens
+ *                    once the daemon has finished initializing
+ *   sigterm_to_exit  sending SIGTERM to the pid read from the pid file until
+ *                    the daemon has exited
+ *   lock_race        many starters racing for the same lock file, of which
+ *                    exactly one must win
+ *
+ * Results are written as CSV so they can be compared between builds.
+ */
+
+extern char **environ;
+
+/*
+ * Upper bound for iterations, concurrency, and racers
+ */
+#define MAX_COUNT 10000
+
+/*
+ * Per metric samples in microseconds
+ */
+struct metric {
+    const char *name;
+    long       *samples;
+    int        count;
+    int        failures;
+    double     elapsed_s;
+};
+
+static long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void fail(const char *message) {
+    fprintf(stderr, "daemon-stress: %s: %s\n", message, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Start one instance of the daemon with its own lock and pid file.  Its
+ * output is discarded so only the timing is measured.
+ */
+static pid_t start_daemon(const char *binary, const char *lockfile,
+    const char *pidfile) {
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    char *argv[] = { (char *)binary, "-d", "-l", (char *)lockfile,
+        "-p", (char *)pidfile, 0 };
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+    errno = posix_spawn(&pid, binary, &actions, NULL, argv, environ);
+    if (errno != 0)
+        fail("unable to start daemon");
+
+    posix_spawn_file_actions_destroy(&actions);
+    return pid;
+}
+
+static pid_t read_pidfile(const char *pidfile) {
+    FILE *pid_file = fopen(pidfile, "r");
+    int pid = -1;
+
+    if (pid_file == NULL)
+        return -1;
+    if (fscanf(pid_file, "%d", &pid) != 1)
+        pid = -1;
+    fclose(pid_file);
+    return pid;
+}
+
+/*
+ * Stop a daemon and return the time from SIGTERM until it exited, or -1.
+ * Because the harness is a child subreaper, the daemon is re-parented to us
+ * and can be waited on directly instead of polling.
+ */
+static long stop_daemon(pid_t daemon_pid) {
+    long start = now_us();
+
+    if (kill(daemon_pid, SIGTERM) == -1)
+        return -1;
+    if (waitpid(daemon_pid, NULL, 0) == -1)
+        return -1;
+    return now_us() - start;
+}
+
+/*
+ * Reap the intermediate children of make_daemon() that were re-parented to us
+ */
+static void reap_strays() {
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        ;
+}
+
+static void record(struct metric *m, long sample_us) {
+    if (sample_us < 0)
+        m->failures++;
+    else
+        m->samples[m->count++] = sample_us;
+}
+
+/*
+ * Start "concurrency" daemons at once, wait until all are ready, then stop
+ * them all
+ */
+static void lifecycle_round(const char *binary, const char *work_dir,
+    int concurrency, struct metric *ready, struct metric *stop) {
+    char lockfile[PATH_MAX], pidfile[PATH_MAX];
+    pid_t starters[concurrency];
+    long started[concurrency];
+
+    for (int i = 0; i < concurrency; i++) {
+        snprintf(lockfile, PATH_MAX, "%s/daemon-%d.lock", work_dir, i);
+        snprintf(pidfile, PATH_MAX, "%s/daemon-%d.pid", work_dir, i);
+        unlink(pidfile);
+        started[i] = now_us();
+        starters[i] = start_daemon(binary, lockfile, pidfile);
+    }
+
+    for (int i = 0; i < concurrency; i++) {
+        int wstatus;
+
+        if (waitpid(starters[i], &wstatus, 0) == -1
+            || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+            record(ready, -1);
+        else
+            record(ready, now_us() - started[i]);
+    }
+
+    for (int i = 0; i < concurrency; i++) {
+        snprintf(pidfile, PATH_MAX, "%s/daemon-%d.pid", work_dir, i);
+        pid_t daemon_pid = read_pidfile(pidfile);
+        record(stop, daemon_pid > 0 ? stop_daemon(daemon_pid) : -1);
+    }
+
+    reap_strays();
+}
+
+/*
+ * Start "racers" daemons against the same lock file.  check_if_running() must
+ * let exactly one of them through.
+ */
+static void lock_race_round(const char *binary, const char *work_dir,
+    int racers, struct metric *race) {
+    char lockfile[PATH_MAX], pidfile[PATH_MAX];
+    pid_t starters[racers];
+    int winners = 0;
+
+    snprintf(lockfile, PATH_MAX, "%s/race.lock", work_dir);
+    snprintf(pidfile, PATH_MAX, "%s/race.pid", work_dir);
+    unlink(pidfile);
+
+    long start = now_us();
+    for (int i = 0; i < racers; i++)
+        starters[i] = start_daemon(binary, lockfile, pidfile);
+
+    for (int i = 0; i < racers; i++) {
+        int wstatus;
+
+        if (waitpid(starters[i], &wstatus, 0) != -1
+            && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0)
+            winners++;
+    }
+    long elapsed = now_us() - start;
+
+    pid_t daemon_pid = read_pidfile(pidfile);
+    if (daemon_pid > 0)
+        stop_daemon(daemon_pid);
+    reap_strays();
+
+    record(race, winners == 1 ? elapsed : -1);
+}
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static long percentile(struct metric *m, int pct) {
+    if (m->count == 0)
+        return 0;
+    return m->samples[(m->count - 1) * pct / 100];
+}
+
+static void report(FILE *out, struct metric *m) {
+    qsort(m->samples, m->count, sizeof(long), compare_long);
+
+    fprintf(out, "%s,%d,%d,%ld,%ld,%ld,%ld,%ld,%.2f\n", m->name, m->count,
+        m->failures, m->count ? m->samples[0] : 0, percentile(m, 50),
+        percentile(m, 90), percentile(m, 99),
+        m->count ? m->samples[m->count - 1] : 0,
+        m->elapsed_s > 0 ? m->count / m->elapsed_s : 0);
+}
+
+/*
+ * Parse a positive count from the command line.  Returns -1 if the argument
+ * is not a number or out of range.
+ */
+static int parse_count(const char *arg, int max) {
+    char *end;
+
+    errno = 0;
+    long value = strtol(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || value < 1 || value > max)
+        return -1;
+    return value;
+}
+
+void usage(char **argv) {
+    printf("Usage: %s [OPTIONS]\n\n", argv[0]);
+    printf("  -b, --binary      Daemon executable to exercise\n");
+    printf("                    Default is ./simple-daemon\n");
+    printf("  -n, --iterations  Number of rounds per test\n");
+    printf("                    Default is 10\n");
+    printf("  -c, --concurrency Daemons started and stopped together\n");
+    printf("                    Default is 4\n");
+    printf("  -r, --racers      Starters competing for the same lock file\n");
+    printf("                    Default is 8\n");
+    printf("  -o, --output      CSV output file\n");
+    printf("                    Default is standard output\n");
+    printf("  -h, --help        These usage instructions\n\n");
+}
+
+int main(int argc, char **argv) {
+    char binary[PATH_MAX] = "./simple-daemon";
+    char *output = 0;
+    int iterations = 10, concurrency = 4, racers = 8;
+
+    static struct option long_options[] = {
+        {"binary",      required_argument, 0, 'b'},
+        {"iterations",  required_argument, 0, 'n'},
+        {"concurrency", required_argument, 0, 'c'},
+        {"racers",      required_argument, 0, 'r'},
+        {"output",      required_argument, 0, 'o'},
+        {"help",        no_argument,       0, 'h'},
+        {0,             0,                 0,  0}
+    };
+
+    while (1) {
+        int c = getopt_long(argc, argv, "b:n:c:r:o:h", long_options, 0);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'b' :
+            strcpy(binary, optarg);
+            break;
+
+        case 'n' :
+            if ((iterations = parse_count(optarg, MAX_COUNT)) == -1) {
+                usage(argv);
+                exit(1);
+            }
+            break;
+
+        case 'c' :
+            if ((concurrency = parse_count(optarg, MAX_COUNT)) == -1) {
+                usage(argv);
+                exit(1);
+            }
+            break;
+
+        case 'r' :
+            if ((racers = parse_count(optarg, MAX_COUNT)) == -1) {
+                usage(argv);
+                exit(1);
+            }
+            break;
+
+        case 'o' :
+            output = optarg;
+            break;
+
+        case 'h' :
+        default:
+            usage(argv);
+            exit(0);
+        }
+    }
+
+    /*
+     * the daemon changes directory to / so every path must be absolute
+     */
+    char actual_binary[PATH_MAX];
+    if (realpath(binary, actual_binary) == NULL)
+        fail("unable to find daemon executable");
+
+    char work_dir[] = "/tmp/daemon-stress-XXXXXX";
+    if (mkdtemp(work_dir) == NULL)
+        fail("unable to create work directory");
+
+    /*
+     * become a subreaper so the double-forked daemons are re-parented to us
+     */
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1)
+        fail("unable to become child subreaper");
+
+    struct metric ready = { .name = "start_to_ready" };
+    struct metric stop  = { .name = "sigterm_to_exit" };
+    struct metric race  = { .name = "lock_race" };
+
+    ready.samples = calloc(iterations * concurrency, sizeof(long));
+    stop.samples = calloc(iterations * concurrency, sizeof(long));
+    race.samples = calloc(iterations, sizeof(long));
+    if (!ready.samples || !stop.samples || !race.samples)
+        fail("unable to allocate samples");
+
+    long start = now_us();
+    for (int i = 0; i < iterations; i++)
+        lifecycle_round(actual_binary, work_dir, concurrency, &ready, &stop);
+    ready.elapsed_s = stop.elapsed_s = (now_us() - start) / 1e6;
+
+    start = now_us();
+    for (int i = 0; i < iterations; i++)
+        lock_race_round(actual_binary, work_dir, racers, &race);
+    race.elapsed_s = (now_us() - start) / 1e6;
+
+    FILE *out = stdout;
+    if (output && (out = fopen(output, "w")) == NULL)
+        fail("unable to open output file");
+
+    fprintf(out, "metric,count,failures,min_us,p50_us,p90_us,p99_us,max_us,"
+        "per_second\n");
+    report(out, &ready);
+    report(out, &stop);
+    report(out, &race);
+
+    if (out != stdout)
+        fclose(out);
+
+    /*
+     * leave the work directory behind if anything failed so it can be
+     * inspected
+     */
+    int failed = ready.failures + stop.failures + race.failures;
+    if (!failed) {
+        char filename[PATH_MAX];
+
+        for (int i = 0; i < concurrency; i++) {
+            snprintf(filename, PATH_MAX, "%s/daemon-%d.lock", work_dir, i);
+            unlink(filename);
+            snprintf(filename, PATH_MAX, "%s/daemon-%d.pid", work_dir, i);
+            unlink(filename);
+            snprintf(filename, PATH_MAX, "%s/daemon-%d.pid.state", work_dir,
+                i);
+            unlink(filename);
+        }
+        snprintf(filename, PATH_MAX, "%s/race.lock", work_dir);
+        unlink(filename);
+        snprintf(filename, PATH_MAX, "%s/race.pid", work_dir);
+        unlink(filename);
+        snprintf(filename, PATH_MAX, "%s/race.pid.state", work_dir);
+        unlink(filename);
+        rmdir(work_dir);
+    } else
+        fprintf(stderr, "daemon-stress: %d failures, see %s\n", failed,
+            work_dir);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,289 @@
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "timer.h"
+
+/*
+ * Benchmark of the timing wheel in timer.c against a binary heap, the usual
+ * alternative.  Both get the same workload:
+ *
+ *   insert  add timers with random timeouts up to the given maximum
+ *   cancel  cancel a share of them in random order
+ *   expire  advance the clock one millisecond at a time until every remaining
+ *           timer has fired
+ *
+ * Every expiry is checked to happen at exactly its tick.  Results are written
+ * as CSV with the cost of each operation in nanoseconds.
+ */
+
+static uint32_t *expires;         // expected tick of each timer
+static long     now;              // simulated clock
+static long     fired, wrong;
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t next_random() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void fail(const char *message) {
+    fprintf(stderr, "timer-bench: %s\n", message);
+    exit(EXIT_FAILURE);
+}
+
+static void expired(void *arg) {
+    fired++;
+    if (expires[(intptr_t)arg] != now)
+        wrong++;
+}
+
+/*
+ * A binary min-heap of timers.  Each timer remembers its position in the
+ * heap so that it can be cancelled without searching.
+ */
+struct heap_timer {
+    uint32_t expires;
+    uint32_t position;            // UINT32_MAX when not in the heap
+};
+
+static struct heap_timer *heap_timers;
+static uint32_t          *heap;   // indexes into heap_timers
+static uint32_t          heap_size;
+
+static int heap_less(uint32_t a, uint32_t b) {
+    return heap_timers[heap[a]].expires < heap_timers[heap[b]].expires;
+}
+
+static void heap_swap(uint32_t a, uint32_t b) {
+    uint32_t t = heap[a];
+    heap[a] = heap[b];
+    heap[b] = t;
+    heap_timers[heap[a]].position = a;
+    heap_timers[heap[b]].position = b;
+}
+
+static void heap_up(uint32_t pos) {
+    while (pos > 0 && heap_less(pos, (pos - 1) / 2)) {
+        heap_swap(pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
+}
+
+static void heap_down(uint32_t pos) {
+    while (1) {
+        uint32_t smallest = pos, left = 2 * pos + 1, right = left + 1;
+
+        if (left < heap_size && heap_less(left, smallest))
+            smallest = left;
+        if (right < heap_size && heap_less(right, smallest))
+            smallest = right;
+        if (smallest == pos)
+            return;
+
+        heap_swap(pos, smallest);
+        pos = smallest;
+    }
+}
+
+static void heap_add(uint32_t id, uint32_t when) {
+    heap_timers[id].expires = when;
+    heap_timers[id].position = heap_size;
+    heap[heap_size++] = id;
+    heap_up(heap_size - 1);
+}
+
+static void heap_cancel(uint32_t id) {
+    uint32_t pos = heap_timers[id].position;
+
+    if (pos == UINT32_MAX)
+        return;
+
+    heap_timers[id].position = UINT32_MAX;
+    if (pos != --heap_size) {
+        heap[pos] = heap[heap_size];
+        heap_timers[heap[pos]].position = pos;
+        heap_down(pos);
+        heap_up(pos);
+    }
+}
+
+static void heap_run(long until) {
+    while (heap_size > 0 && heap_timers[heap[0]].expires <= until) {
+        uint32_t id = heap[0];
+        heap_cancel(id);
+        expired((void *)(intptr_t)id);
+    }
+}
+
+static void report(const char *structure, const char *operation, long count,
+    long elapsed_ns) {
+    printf("%s,%s,%ld,%.1f\n", structure, operation, count,
+        count ? (double)elapsed_ns / count : 0);
+}
+
+/*
+ * Shuffled order in which timers are cancelled
+ */
+static void shuffle(uint32_t *order, long count) {
+    for (long i = 0; i < count; i++)
+        order[i] = i;
+    for (long i = count - 1; i > 0; i--) {
+        long j = next_random() % (i + 1);
+        uint32_t t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+}
+
+static void bench_wheel(long count, long cancels, long max_delay,
+    uint32_t *order) {
+    timer_id *ids = malloc(count * sizeof(timer_id));
+    if (ids == NULL)
+        fail("unable to allocate timer ids");
+
+    now = fired = wrong = 0;
+    timer_init(now);
+
+    long start = now_ns();
+    for (long i = 0; i < count; i++)
+        if ((ids[i] = timer_add(expires[i], expired, (void *)(intptr_t)i)) == 0)
+            fail("unable to add timer");
+    report("wheel", "insert", count, now_ns() - start);
+
+    start = now_ns();
+    for (long i = 0; i < cancels; i++)
+        if (timer_cancel(ids[order[i]]) != 1)
+            fail("unable to cancel timer");
+    report("wheel", "cancel", cancels, now_ns() - start);
+
+    start = now_ns();
+    for (now = 1; now <= max_delay; now++)
+        timer_run(now);
+    report("wheel", "expire", fired, now_ns() - start);
+
+    if (fired != count - cancels || wrong != 0 || timer_pending() != 0)
+        fail("wheel expired the wrong timers");
+
+    timer_close();
+    free(ids);
+}
+
+static void bench_heap(long count, long cancels, long max_delay,
+    uint32_t *order) {
+    heap_timers = malloc(count * sizeof(struct heap_timer));
+    heap = malloc(count * sizeof(uint32_t));
+    if (heap_timers == NULL || heap == NULL)
+        fail("unable to allocate heap");
+
+    now = fired = wrong = 0;
+    heap_size = 0;
+
+    long start = now_ns();
+    for (long i = 0; i < count; i++)
+        heap_add(i, expires[i]);
+    report("heap", "insert", count, now_ns() - start);
+
+    start = now_ns();
+    for (long i = 0; i < cancels; i++)
+        heap_cancel(order[i]);
+    report("heap", "cancel", cancels, now_ns() - start);
+
+    start = now_ns();
+    for (now = 1; now <= max_delay; now++)
+        heap_run(now);
+    report("heap", "expire", fired, now_ns() - start);
+
+    if (fired != count - cancels || wrong != 0 || heap_size != 0)
+        fail("heap expired the wrong timers");
+
+    free(heap_timers);
+    free(heap);
+}
+
+void usage(char **argv) {
+    printf("Usage: %s [OPTIONS]\n\n", argv[0]);
+    printf("  -n, --timers      Number of timers\n");
+    printf("                    Default is 1000000\n");
+    printf("  -d, --max-delay   Longest timeout in milliseconds\n");
+    printf("                    Default is 600000\n");
+    printf("  -c, --cancel      Percentage of timers cancelled\n");
+    printf("                    Default is 50\n");
+    printf("  -h, --help        These usage instructions\n\n");
+}
+
+int main(int argc, char **argv) {
+    long count = 1000000, max_delay = 600000, cancel_percent = 50;
+
+    static struct option long_options[] = {
+        {"timers",    required_argument, 0, 'n'},
+        {"max-delay", required_argument, 0, 'd'},
+        {"cancel",    required_argument, 0, 'c'},
+        {"help",      no_argument,       0, 'h'},
+        {0,           0,                 0,  0}
+    };
+
+    while (1) {
+        int c = getopt_long(argc, argv, "n:d:c:h", long_options, 0);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'n' :
+            count = atol(optarg);
+            break;
+
+        case 'd' :
+            max_delay = atol(optarg);
+            break;
+
+        case 'c' :
+            cancel_percent = atol(optarg);
+            break;
+
+        case 'h' :
+        default:
+            usage(argv);
+            exit(0);
+        }
+    }
+
+    if (count < 1 || count > (long)TIMER_SLAB_SIZE * TIMER_MAX_SLABS
+        || max_delay < 1 || max_delay > UINT32_MAX
+        || cancel_percent < 0 || cancel_percent > 100) {
+        usage(argv);
+        exit(1);
+    }
+
+    expires = malloc(count * sizeof(uint32_t));
+    uint32_t *order = malloc(count * sizeof(uint32_t));
+    if (expires == NULL || order == NULL)
+        fail("unable to allocate timers");
+
+    /* every timer expires at least one tick after it was added */
+    for (long i = 0; i < count; i++)
+        expires[i] = 1 + next_random() % max_delay;
+    shuffle(order, count);
+
+    long cancels = count * cancel_percent / 100;
+
+    printf("structure,operation,count,ns_per_op\n");
+    bench_wheel(count, cancels, max_delay, order);
+    bench_heap(count, cancels, max_delay, order);
+
+    free(expires);
+    free(order);
+    return 0;
+}
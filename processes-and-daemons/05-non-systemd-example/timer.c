@@ -0,0 +1,428 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "timer.h"
+
+/*
+ * A hierarchical timing wheel, as described by Varghese and Lauck in
+ * "Hashed and Hierarchical Timing Wheels" and long used by the Linux kernel.
+ *
+ * Time is counted in ticks of one millisecond.  Level 0 has one slot per
+ * tick for the next 256 ticks.  Each slot of level 1 covers 256 ticks, each
+ * slot of level 2 covers 65536 ticks, and so on.  A timer goes into the lowest
+ * level that reaches its expiry, and into the slot that contains it.  When
+ * the current tick enters a slot of a higher level, that slot is "cascaded":
+ * its timers are placed again, now into a lower level.  Every timer is moved
+ * at most once per level, so adding, cancelling, and expiring a timer all
+ * take constant time, unlike a heap, where they take O(log n).
+ *
+ * Each level keeps a bitmap of its non-empty slots.  This is used to find the
+ * next tick that has any work, to skip empty ticks, and to arm a single
+ * timerfd for that tick in the event loop.
+ */
+#define SLOTS     (1 << TIMER_WHEEL_BITS)
+#define SLOT_MASK (SLOTS - 1)
+#define MAX_DELAY ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+#define NEVER     UINT64_MAX
+
+struct link {
+    struct link *next;
+    struct link *prev;
+};
+
+struct timer {
+    struct link   link;           // must be first
+    uint64_t      expires;        // tick
+    timer_handler handler;
+    void          *arg;
+    uint32_t      index;          // position in the slabs
+    uint32_t      generation;     // bumped whenever the timer is freed
+    uint16_t      slot;           // level * SLOTS + slot, while pending
+};
+
+static struct link wheel[TIMER_WHEEL_LEVELS][SLOTS];
+static uint64_t    occupied[TIMER_WHEEL_LEVELS][SLOTS / 64];
+
+static uint64_t current;          // next tick to process
+static uint64_t clock_now;        // latest known time
+static uint64_t next_due = NEVER; // no work before this tick
+static long     pending;
+
+/*
+ * Timers are never returned to malloc.  Freed timers go onto a free list
+ * threaded through link.next and are reused.
+ */
+static struct timer *slabs[TIMER_MAX_SLABS];
+static int          slab_count;
+static struct timer *free_list;
+
+static int      timer_fd = -1;
+static uint64_t armed = NEVER;    // tick the timerfd is set for
+
+static long clock_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static int grow_slabs() {
+    if (slab_count == TIMER_MAX_SLABS)
+        return -1;
+
+    struct timer *slab = calloc(TIMER_SLAB_SIZE, sizeof(struct timer));
+    if (slab == NULL)
+        return -1;
+
+    for (int i = TIMER_SLAB_SIZE - 1; i >= 0; i--) {
+        slab[i].index = slab_count * TIMER_SLAB_SIZE + i;
+        slab[i].generation = 1;
+        slab[i].link.next = (struct link *)free_list;
+        free_list = &slab[i];
+    }
+    slabs[slab_count++] = slab;
+    return 0;
+}
+
+static void free_timer(struct timer *t) {
+    if (++t->generation == 0)
+        t->generation = 1;
+    t->link.prev = NULL;
+    t->link.next = (struct link *)free_list;
+    free_list = t;
+}
+
+/*
+ * Put a timer into the slot that holds its expiry, relative to the current
+ * tick
+ */
+static void place(struct timer *t) {
+    if (t->expires < current)
+        t->expires = current;
+    if (t->expires - current > MAX_DELAY)
+        t->expires = current + MAX_DELAY;
+
+    uint64_t delta = t->expires - current;
+    int level = 0;
+    while (delta >> (TIMER_WHEEL_BITS * (level + 1)))
+        level++;
+
+    int slot = (t->expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+    struct link *head = &wheel[level][slot];
+
+    t->slot = level * SLOTS + slot;
+    t->link.next = head;
+    t->link.prev = head->prev;
+    head->prev->next = &t->link;
+    head->prev = &t->link;
+    occupied[level][slot / 64] |= 1ULL << (slot % 64);
+}
+
+static void unlink_timer(struct timer *t) {
+    int level = t->slot / SLOTS;
+    int slot = t->slot % SLOTS;
+
+    t->link.prev->next = t->link.next;
+    t->link.next->prev = t->link.prev;
+    if (wheel[level][slot].next == &wheel[level][slot])
+        occupied[level][slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+/*
+ * Move all timers of a slot onto a private list and mark the slot empty
+ */
+static void take_slot(int level, int slot, struct link *list) {
+    struct link *head = &wheel[level][slot];
+
+    if (head->next == head) {
+        list->next = list->prev = list;
+        return;
+    }
+
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    head->next = head->prev = head;
+    occupied[level][slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+/*
+ * First non-empty slot at or after "from" in a level, or -1
+ */
+static int find_slot(int level, int from) {
+    for (int word = from / 64; word < SLOTS / 64; word++) {
+        uint64_t bits = occupied[level][word];
+        if (word == from / 64)
+            bits &= ~0ULL << (from % 64);
+        if (bits)
+            return word * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+/*
+ * The next tick at which a timer expires or a slot must be cascaded
+ */
+static uint64_t next_tick() {
+    uint64_t next = NEVER;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t span = 1ULL << (TIMER_WHEEL_BITS * level);
+        uint64_t lap = span << TIMER_WHEEL_BITS;
+        uint64_t base = current & ~(lap - 1);
+
+        /* slots that start before the current tick come around next lap */
+        int from = (current - base + span - 1) / span;
+        int slot = from < SLOTS ? find_slot(level, from) : -1;
+        if (slot == -1 && (slot = find_slot(level, 0)) != -1)
+            base += lap;
+
+        if (slot != -1 && base + slot * span < next)
+            next = base + slot * span;
+    }
+
+    return next;
+}
+
+/*
+ * Set the timerfd for a tick, or disarm it
+ */
+static void arm(uint64_t tick) {
+    struct itimerspec when;
+
+    if (timer_fd == -1 || tick == armed)
+        return;
+
+    memset(&when, 0, sizeof(when));
+    if (tick != NEVER) {
+        when.it_value.tv_sec = tick / 1000;
+        when.it_value.tv_nsec = (tick % 1000) * 1000000;
+    }
+
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &when, NULL);
+    armed = tick;
+}
+
+/*
+ * Process the current tick: cascade the higher level slots that it enters,
+ * then expire the timers in its level 0 slot
+ */
+static void run_tick() {
+    struct link list;
+
+    if ((current & SLOT_MASK) == 0)
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            int slot = (current >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+
+            take_slot(level, slot, &list);
+            while (list.next != &list) {
+                struct timer *t = (struct timer *)list.next;
+                list.next = t->link.next;
+                place(t);
+            }
+
+            if (slot != 0)
+                break;
+        }
+
+    take_slot(0, current & SLOT_MASK, &list);
+
+    /*
+     * timers added by the handlers below must not land in this tick
+     */
+    current++;
+
+    /*
+     * the list stays linked while handlers run, so that they can cancel
+     * other timers on it
+     */
+    while (list.next != &list) {
+        struct timer *t = (struct timer *)list.next;
+        timer_handler handler = t->handler;
+        void *arg = t->arg;
+
+        list.next = t->link.next;
+        list.next->prev = &list;
+        pending--;
+        free_timer(t);
+        handler(arg);
+    }
+}
+
+static void handle_timerfd(int fd, unsigned int events, void *arg) {
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+        return;
+
+    armed = NEVER;
+    timer_run(clock_ms());
+}
+
+/*
+ * Start an empty wheel at now_ms.  The wheel only moves when timer_run() is
+ * called, see timer_open() to have the event loop do that.
+ */
+int timer_init(long now_ms) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        for (int slot = 0; slot < SLOTS; slot++)
+            wheel[level][slot].next = wheel[level][slot].prev =
+                &wheel[level][slot];
+
+    memset(occupied, 0, sizeof(occupied));
+    current = clock_now = now_ms;
+    next_due = NEVER;
+    pending = 0;
+    return 0;
+}
+
+/*
+ * Start a wheel that runs on the monotonic clock.  A single timerfd in the
+ * event loop is kept armed for the next tick that has work.
+ */
+int timer_open() {
+    timer_init(clock_ms());
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1)
+        return -1;
+
+    if (event_add(timer_fd, EPOLLIN, handle_timerfd, NULL) == -1) {
+        close(timer_fd);
+        timer_fd = -1;
+        return -1;
+    }
+
+    armed = NEVER;
+    return 0;
+}
+
+/*
+ * Call handler with arg after delay_ms.  Returns an id for timer_cancel(),
+ * or 0 if no more timers can be allocated.
+ */
+timer_id timer_add(long delay_ms, timer_handler handler, void *arg) {
+    if (free_list == NULL && grow_slabs() == -1)
+        return 0;
+
+    struct timer *t = free_list;
+    free_list = (struct timer *)t->link.next;
+
+    if (timer_fd != -1)
+        clock_now = clock_ms();
+
+    if (delay_ms < 0)
+        delay_ms = 0;
+    if ((uint64_t)delay_ms > MAX_DELAY)
+        delay_ms = MAX_DELAY;
+
+    t->expires = clock_now + delay_ms;
+    t->handler = handler;
+    t->arg = arg;
+    place(t);
+    pending++;
+
+    /*
+     * the timerfd only needs to move if the new timer, or the cascade that
+     * brings it down to level 0, comes before whatever it is armed for
+     */
+    int level = t->slot / SLOTS;
+    uint64_t tick = t->expires & ~((1ULL << (TIMER_WHEEL_BITS * level)) - 1);
+    if (tick < next_due) {
+        next_due = tick;
+        arm(tick);
+    }
+
+    return (uint64_t)t->generation << 32 | t->index;
+}
+
+/*
+ * Cancel a pending timer.  Returns 1 if it was cancelled, or 0 if it already
+ * expired or was cancelled before.
+ */
+int timer_cancel(timer_id id) {
+    uint32_t index = id & 0xffffffff;
+    uint32_t generation = id >> 32;
+
+    if (index >= (uint32_t)slab_count * TIMER_SLAB_SIZE)
+        return 0;
+
+    struct timer *t = &slabs[index / TIMER_SLAB_SIZE][index % TIMER_SLAB_SIZE];
+    if (t->generation != generation || t->link.prev == NULL)
+        return 0;
+
+    unlink_timer(t);
+    pending--;
+    free_timer(t);
+
+    /*
+     * next_due may now be early.  An early wake up is harmless, so it and the
+     * timerfd are left alone.
+     */
+    return 1;
+}
+
+/*
+ * Expire every timer due at or before now_ms.  Ticks without work are
+ * skipped rather than stepped through.
+ */
+void timer_run(long now_ms) {
+    uint64_t now = now_ms;
+
+    if (now > clock_now)
+        clock_now = now;
+
+    /* nothing to do yet, which is the common case when stepping the clock */
+    if (now < next_due) {
+        if (current <= now)
+            current = now + 1;
+        arm(next_due);
+        return;
+    }
+
+    while (current <= now) {
+        uint64_t next = next_tick();
+        if (next > now) {
+            current = now + 1;
+            break;
+        }
+
+        current = next;
+        run_tick();
+    }
+
+    next_due = next_tick();
+    arm(next_due);
+}
+
+/*
+ * Tick of the next timer expiry or cascade, or -1 if no timers are pending
+ */
+long timer_next() {
+    uint64_t next = next_tick();
+    return next == NEVER ? -1 : (long)next;
+}
+
+long timer_pending() {
+    return pending;
+}
+
+void timer_close() {
+    if (timer_fd != -1) {
+        event_del(timer_fd);
+        close(timer_fd);
+        timer_fd = -1;
+    }
+
+    for (int i = 0; i < slab_count; i++)
+        free(slabs[i]);
+    slab_count = 0;
+    free_list = NULL;
+    timer_init(clock_now);
+}
@@ -0,0 +1,40 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+
+/*
+ * Each level of the wheel has 2^TIMER_WHEEL_BITS slots.  Four levels of 256
+ * slots cover timeouts of up to 2^32 ms, about 49 days.  Longer timeouts are
+ * clamped.
+ */
+#define TIMER_WHEEL_BITS   8
+#define TIMER_WHEEL_LEVELS 4
+
+/*
+ * Timers are allocated in slabs of TIMER_SLAB_SIZE, so at most
+ * TIMER_SLAB_SIZE * TIMER_MAX_SLABS timers can be pending at once
+ */
+#define TIMER_SLAB_SIZE 4096
+#define TIMER_MAX_SLABS 1024
+
+/*
+ * Identifies a pending timer.  Zero is never a valid id.
+ */
+typedef uint64_t timer_id;
+
+/*
+ * Called once when the timer expires
+ */
+typedef void (*timer_handler)(void *arg);
+
+int      timer_init(long now_ms);
+int      timer_open();
+timer_id timer_add(long delay_ms, timer_handler handler, void *arg);
+int      timer_cancel(timer_id id);
+void     timer_run(long now_ms);
+long     timer_next();
+long     timer_pending();
+void     timer_close();
+
+#endif
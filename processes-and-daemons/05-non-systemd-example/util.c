@@ -1,47 +1,304 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <paths.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "logfile.h"
+#include "logring.h"
+#include "probes.h"
 #include "util.h"
 
-static void log_message(int priority, FILE *stream, char *format, va_list vargs)
+/*
+ * Longest message, including the trailing newline
+ */
+#define LOG_RECORD_MAX 1024
+
+/*
+ * Room reserved in front of each message for the log file's prefix
+ */
+#define LOG_PREFIX_MAX 128
+
+/*
+ * Syslog facility used when talking to /dev/log directly
+ */
+#define LOG_FACILITY LOG_USER
+
+/*
+ * Messages less important than this syslog priority are discarded
+ */
+static int log_level = LOG_INFO;
+
+/*
+ * Every line starts with the time and "name[pid]: ", e.g.
+ *
+ *   log file  "2024-01-02T03:04:05 name[pid]: "
+ *   syslog    "Jan  2 03:04:05 name[pid]: "
+ *
+ * These prefixes are only rebuilt when the second or the process changes, so
+ * most lines are formatted exactly once, by the vsnprintf() of the message
+ * itself.
+ */
+static time_t cached_second = -1;
+static pid_t  cached_pid;
+static char   file_prefix[LOG_PREFIX_MAX];
+static size_t file_prefix_len;
+static char   syslog_prefix[LOG_PREFIX_MAX];
+static size_t syslog_prefix_len;
+
+/*
+ * Datagram socket connected to the syslog daemon, or -1
+ */
+static int    syslog_enabled = 1;
+static int    syslog_fd = -1;
+static time_t syslog_retry = -1;
+
+static void forget_pid() {
+    cached_pid = 0;
+}
+
+static void refresh_prefixes() {
+    static int registered;
+    struct timespec ts;
+    struct tm now_tm;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if (ts.tv_sec == cached_second && cached_pid != 0)
+        return;
+
+    if (!registered) {
+        pthread_atfork(NULL, NULL, forget_pid);
+        registered = 1;
+    }
+    if (cached_pid == 0)
+        cached_pid = getpid();
+    cached_second = ts.tv_sec;
+
+    localtime_r(&ts.tv_sec, &now_tm);
+    file_prefix_len = strftime(file_prefix, sizeof(file_prefix),
+        "%Y-%m-%dT%H:%M:%S ", &now_tm);
+    file_prefix_len += snprintf(file_prefix + file_prefix_len,
+        sizeof(file_prefix) - file_prefix_len, "%s[%d]: ",
+        program_invocation_short_name, cached_pid);
+    if (file_prefix_len > sizeof(file_prefix) - 1)
+        file_prefix_len = sizeof(file_prefix) - 1;
+
+    /* the RFC 3164 timestamp, e.g. "Jan  2 03:04:05" */
+    syslog_prefix_len = strftime(syslog_prefix, sizeof(syslog_prefix),
+        "%b %e %H:%M:%S ", &now_tm);
+    syslog_prefix_len += snprintf(syslog_prefix + syslog_prefix_len,
+        sizeof(syslog_prefix) - syslog_prefix_len, "%s[%d]: ",
+        program_invocation_short_name, cached_pid);
+    if (syslog_prefix_len > sizeof(syslog_prefix) - 1)
+        syslog_prefix_len = sizeof(syslog_prefix) - 1;
+}
+
+/*
+ * Connect to the syslog daemon.  If it isn't there, try again at most once a
+ * second rather than on every message.
+ */
+static int connect_syslog() {
+    struct sockaddr_un addr = { AF_UNIX, _PATH_LOG };
+
+    if (cached_second == syslog_retry)
+        return -1;
+
+    syslog_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (syslog_fd != -1
+        && connect(syslog_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(syslog_fd);
+        syslog_fd = -1;
+    }
+
+    if (syslog_fd == -1)
+        syslog_retry = cached_second;
+    return syslog_fd;
+}
+
+/*
+ * Send a message to syslog as "<PRI>TIMESTAMP name[pid]: message", with one
+ * system call.  This is what syslog(3) does too, without its lock and its
+ * formatting of the message into a temporary stream.  Unlike syslog(3), a
+ * message is dropped rather than blocking the daemon if the syslog daemon
+ * falls behind.  setlogmask() has no effect here, log_set_level() decides
+ * which messages are sent.
+ */
+static void send_syslog(int priority, char *message, size_t len) {
+    char pri[8];
+    int pri_len = snprintf(pri, sizeof(pri), "<%d>", LOG_FACILITY | priority);
+    struct iovec iov[3] = {
+        { pri, pri_len },
+        { syslog_prefix, syslog_prefix_len },
+        { message, len }
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 3 };
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (syslog_fd == -1 && connect_syslog() == -1)
+            return;
+        if (sendmsg(syslog_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != -1
+            || errno == EAGAIN)
+            return;
+
+        /* the syslog daemon restarted, or the descriptor was closed */
+        close(syslog_fd);
+        syslog_fd = -1;
+    }
+}
+
+/*
+ * Write the whole line with a single call, so lines of processes sharing the
+ * terminal don't tear.  Writes to a pipe of up to PIPE_BUF bytes are atomic.
+ */
+static void write_line(int fd, char *line, size_t len) {
+    ssize_t count;
+
+    do {
+        count = write(fd, line, len);
+    } while (count == -1 && errno == EINTR);
+}
+
+/*
+ * Format a message once and send it to each sink.  The message is formatted
+ * behind room for the log file's prefix, so that the log file record can be
+ * built in place.  lead, if not NULL, is put in front of the message.
+ */
+static void log_message(int priority, int fd, const char *lead, char *format,
+    va_list vargs)
 {
-    va_list vargs2;
-    va_copy(vargs2, vargs);
+    char buffer[LOG_PREFIX_MAX + LOG_RECORD_MAX];
+    char *message = buffer + LOG_PREFIX_MAX;
+    size_t len = 0;
+
+    if (priority > log_level)
+        return;
+
+    PROBE1(log_enter, priority);
+    refresh_prefixes();
+
+    if (lead) {
+        len = strlen(lead);
+        if (len > LOG_RECORD_MAX - 1)
+            len = LOG_RECORD_MAX - 1;
+        memcpy(message, lead, len);
+    }
+
+    int rc = vsnprintf(message + len, LOG_RECORD_MAX - len, format, vargs);
+    if (rc > 0)
+        len += rc;
+
+    /* truncate long lines, leaving room for the newline */
+    if (len > LOG_RECORD_MAX - 1)
+        len = LOG_RECORD_MAX - 1;
+    message[len] = '\n';
 
-    vsyslog(priority, format, vargs);
-    vfprintf(stream, format, vargs2);
-    fprintf(stream, "\n");
+    /*
+     * Syslog adds the timestamp and pid itself, but the log file has to carry
+     * them in each record
+     */
+    if (logfile_is_open()) {
+        char *record = message - file_prefix_len;
+        memcpy(record, file_prefix, file_prefix_len);
+        logfile_write(record, file_prefix_len + len + 1);
+    }
 
-    va_end(vargs2);
+    /*
+     * hand the message to the shared log ring if there is one.  Errors from
+     * die() are written directly since the process is about to exit.
+     */
+    if (fd == STDOUT_FILENO && logring_write(priority, message, len) == 0) {
+        PROBE1(log_return, priority);
+        return;
+    }
+
+    if (syslog_enabled)
+        send_syslog(priority, message, len);
+    write_line(fd, message, len + 1);
+
+    PROBE1(log_return, priority);
 }
 
+/*
+ * Report a fatal error on a single line, and exit
+ */
 void die(int line_num, char *format, ...) {
-    syslog(LOG_ERR, "Error at line number: %d", line_num);
-    fprintf(stderr, "\nError at line number: %d\n", line_num);
+    char lead[48];
+    snprintf(lead, sizeof(lead), "Error at line number %d: ", line_num);
 
     va_list vargs;
     va_start(vargs, format);
-    log_message(LOG_ERR, stderr, format, vargs);
+    log_message(LOG_ERR, STDERR_FILENO, lead, format, vargs);
     va_end(vargs);
 
-    fprintf(stderr, "\n");
-
     exit(EXIT_FAILURE);
 }
 
 void log_info(char *format, ...) {
     va_list vargs;
     va_start(vargs, format);
-    log_message(LOG_INFO, stdout, format, vargs);
+    log_message(LOG_INFO, STDOUT_FILENO, NULL, format, vargs);
+    va_end(vargs);
+}
+
+void log_debug(char *format, ...) {
+    va_list vargs;
+    va_start(vargs, format);
+    log_message(LOG_DEBUG, STDOUT_FILENO, NULL, format, vargs);
     va_end(vargs);
 }
 
+/*
+ * Drop the connection to syslog, e.g. before closing all file descriptors or
+ * after the syslog daemon was restarted.  The next message reconnects.
+ */
+void log_reopen() {
+    if (syslog_fd != -1)
+        close(syslog_fd);
+    syslog_fd = -1;
+    syslog_retry = -1;
+}
+
+/*
+ * Change which messages are logged.  Errors reported by die() are always
+ * logged.
+ */
+void log_set_level(int priority) {
+    log_level = priority < LOG_ERR ? LOG_ERR : priority;
+}
+
+int log_get_level() {
+    return log_level;
+}
+
+/*
+ * Stop or resume sending messages to syslog
+ */
+void log_set_syslog(int enabled) {
+    syslog_enabled = enabled;
+    if (!enabled)
+        log_reopen();
+}
+
+/*
+ * Milliseconds from an arbitrary starting point, unaffected by changes to the
+ * system clock
+ */
+long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
 void report_pgs(char *name) {
 	pid_t my_pid = getpid();
 	pid_t my_ppid = getppid();
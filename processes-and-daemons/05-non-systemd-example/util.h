@@ -3,6 +3,12 @@
 
 void die(int line_num, char *format, ...);
 void log_info(char *format, ...);
+void log_debug(char *format, ...);
+void log_reopen();
+void log_set_level(int priority);
+void log_set_syslog(int enabled);
+int  log_get_level();
+long monotonic_ms();
 void report_pgs(char *name);
 
 #endif